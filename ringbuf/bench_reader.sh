@@ -0,0 +1,3 @@
+insmod /bin/ringbuf/src/ringbuf.ko ROLE=0 LOG_MSGS=0
+mknod /dev/ringbuf c 248 0
+insmod /bin/ringbuf/test/bench_rx.ko $@
\ No newline at end of file
@@ -0,0 +1,3 @@
+insmod /bin/ringbuf/src/ringbuf.ko
+mknod /dev/ringbuf c 248 0
+insmod /bin/ringbuf/test/bench_tx.ko $@
\ No newline at end of file
@@ -1 +1 @@
-insmod /bin/ringbuf/src/ringbuf.ko ROLE=0
\ No newline at end of file
+insmod /bin/ringbuf/src/ringbuf.ko ROLE=0 LOG_MSGS=1
\ No newline at end of file
@@ -8,7 +8,6 @@
  * 
  */
 
-#include <linux/kfifo.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -29,33 +28,156 @@
 #include <linux/workqueue.h>
 #include <linux/spinlock_types.h>
 #include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/prefetch.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define RINGBUF_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define RINGBUF_URING_CANCEL
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define RINGBUF_LZ4
+#include <linux/lz4.h>
+#endif
+#if IS_ENABLED(CONFIG_ZSTD_COMPRESS) && IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+#define RINGBUF_ZSTD
+#include <linux/zstd.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+/* the zstd_ API of 5.16 over the ZSTD_ one it replaced */
+typedef ZSTD_parameters zstd_parameters;
+typedef ZSTD_CCtx zstd_cctx;
+typedef ZSTD_DCtx zstd_dctx;
+#define zstd_get_params(level, len)	ZSTD_getParams((level), (len), 0)
+#define zstd_cctx_workspace_bound(cparams)	ZSTD_CCtxWorkspaceBound(*(cparams))
+#define zstd_init_cctx		ZSTD_initCCtx
+#define zstd_compress_cctx(cctx, dst, dlen, src, slen, params) \
+	ZSTD_compressCCtx((cctx), (dst), (dlen), (src), (slen), *(params))
+#define zstd_compress_bound	ZSTD_compressBound
+#define zstd_is_error		ZSTD_isError
+#define zstd_dctx_workspace_bound	ZSTD_DCtxWorkspaceBound
+#define zstd_init_dctx		ZSTD_initDCtx
+#define zstd_decompress_dctx	ZSTD_decompressDCtx
+#endif
+#endif
+
+#include "ringbuf.h"
+#include "ringbuf_core.h"
+#include "ringbuf_copy.h"
+
+#define CREATE_TRACE_POINTS
+#include "ringbuf_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Xiangyu Ren <180110718@mail.hit.edu.cn>");
 MODULE_DESCRIPTION("ring buffer based on Inter-VM shared memory module");
 MODULE_VERSION("1.0");
 
-#define RINGBUF_SZ 512
 #define RINGBUF_MSG_SZ sizeof(rbmsg_hd)
 #define BUF_INFO_SZ sizeof(ringbuf_info)
 #define TRUE 1
 #define FALSE 0
 #define RINGBUF_DEVICE_MINOR_NR 0
-#define QEMU_PROCESS_ID 1
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define SLEEP_PERIOD_MSEC 10
 
 #define IOCTL_MAGIC		('f')
 #define IOCTL_RING		_IOW(IOCTL_MAGIC, 1, u32)
 #define IOCTL_WAIT		_IO(IOCTL_MAGIC, 2)
 #define IOCTL_IVPOSITION	_IOR(IOCTL_MAGIC, 3, u32)
+#define IOCTL_POLICY		_IOW(IOCTL_MAGIC, 4, u32)
+#define IOCTL_STATS		_IOWR(IOCTL_MAGIC, 5, rbchan_stats)
+#define IOCTL_RPC_BIND		_IOW(IOCTL_MAGIC, 6, u32)
+#define IOCTL_RPC_CALL		_IOWR(IOCTL_MAGIC, 7, rbrpc)
+#define IOCTL_RPC_SUBMIT	_IOWR(IOCTL_MAGIC, 8, rbrpc)
+#define IOCTL_RPC_COMPLETE	_IOWR(IOCTL_MAGIC, 9, rbrpc)
+#define IOCTL_RPC_RECV		_IOWR(IOCTL_MAGIC, 10, rbrpc)
+#define IOCTL_RPC_REPLY		_IOW(IOCTL_MAGIC, 11, rbrpc)
+#define IOCTL_EVENTFD		_IOW(IOCTL_MAGIC, 12, rbevent)
+#define IOCTL_SEND		_IOW(IOCTL_MAGIC, 13, rbmsg_io)
+#define IOCTL_RECV		_IOWR(IOCTL_MAGIC, 14, rbmsg_io)
+#define IOCTL_COMPRESS		_IOW(IOCTL_MAGIC, 15, rbcompress)
+#define IOCTL_FILE		_IOW(IOCTL_MAGIC, 16, rbfile_opts)
+#define IOCTL_FILE_STATS	_IOR(IOCTL_MAGIC, 17, rbfile_stats)
 #define IVPOSITION_REG_OFF	0x08
 #define DOORBELL_REG_OFF	0x0c
 
+#define RINGBUF_MAGIC		0x52494e47	/* "RING" */
+#define RINGBUF_VERSION		9
+#define RINGBUF_SUPER_SZ	0x1000
+#define RINGBUF_RING_SZ		PAGE_ALIGN(sizeof(rbring))
+#define RINGBUF_PEER_NONE	0xffffffff
+#define RINGBUF_HEARTBEAT_MSEC	100
+#define RINGBUF_PEER_TIMEOUT_MSEC	1000
+#define RINGBUF_LOCK_BREAK_MSEC	10000
+#define RINGBUF_RPC_MAX_SZ	4096
+#define RINGBUF_LOCK_SPIN	1024
+#define RINGBUF_LOCK_RECHECK_NSEC	20000
+
+/* io_uring command opcodes (sqe->cmd_op), see ringbuf_uring_cmd() */
+#define RINGBUF_URING_SEND	0x01
+#define RINGBUF_URING_RECV	0x02
+#define RINGBUF_URING_RECV_BATCH	0x03
+
+#define RBMSG_RPC_REQ		0x01
+#define RBMSG_RPC_REP		0x02
+#define RBMSG_LZ4		0x04
+#define RBMSG_ZSTD		0x08
+#define RBMSG_COMP_MASK		(RBMSG_LZ4 | RBMSG_ZSTD)
+/* RBMSG_INLINE (0x10) belongs to the slot format of ringbuf_core.h */
+#define RBMSG_REPLY_CHAN(flags)	(((flags) >> 8) & 0xff)
+#define RINGBUF_PREFETCH_MAX	1024	/* bytes of a payload prefetched */
+#define DOORBELL_VAL(peer, vector)	(((peer) << 16) | ((vector) & 0xffff))
+
 static int ROLE = 1;
 MODULE_PARM_DESC(ROLE, "Role of this ringbuf device.");
 module_param(ROLE, int, 0400);
 
+static int LOG_MSGS = 0;
+MODULE_PARM_DESC(LOG_MSGS, "Log the messages the tasklet queues for read(), for debugging (default 0).");
+module_param(LOG_MSGS, int, 0400);
+
+static int DELIVER_KB = 256;
+MODULE_PARM_DESC(DELIVER_KB, "KB of messages per channel the tasklet moves out of the ring for read(), 0 read in place.");
+module_param(DELIVER_KB, int, 0644);
+
+static int ZSTD_LEVEL = 3;
+MODULE_PARM_DESC(ZSTD_LEVEL, "zstd level of the channels compressed with zstd.");
+module_param(ZSTD_LEVEL, int, 0400);
+
+static int PREFETCH = 0;
+MODULE_PARM_DESC(PREFETCH, "Messages the consumer prefetches ahead, slot first and payload half way, 0 none (default until measured on the target).");
+module_param(PREFETCH, int, 0644);
+
+static int COPY_ENGINE = -1;
+MODULE_PARM_DESC(COPY_ENGINE, "Payload copy engine: -1 picks per CPU and length, 0 memcpy, 1 erms, 2 avx2, 3 avx512, 4 nt.");
+module_param(COPY_ENGINE, int, 0400);
+
+static int COPY_VEC_MIN = 2048;
+MODULE_PARM_DESC(COPY_VEC_MIN, "Payload length from which AVX copies are used.");
+module_param(COPY_VEC_MIN, int, 0400);
+
+static int COPY_NT_MIN = 16384;
+MODULE_PARM_DESC(COPY_NT_MIN, "Payload length from which streaming stores are used to send, 0 never.");
+module_param(COPY_NT_MIN, int, 0400);
+
+static int COMBINE = 1;
+MODULE_PARM_DESC(COMBINE, "Concurrent write()s publish through one holder of the write lock, 0 each on its own.");
+module_param(COMBINE, int, 0644);
+
 /* KVM Inter-VM shared memory device register offsets */
 enum {
 	IntrMask        = 0x00,    /* Interrupt Mask */
@@ -64,6 +186,13 @@ enum {
 	Doorbell        = 0x0c,    /* Doorbell */
 };
 
+/* payload compression of a channel, see IOCTL_COMPRESS */
+enum {
+	CompNone	=	0,
+	CompLz4		=	1,
+	CompZstd	=	2,
+};
+
 /* Consumer(reader) or Producer(writer) role of ring buffer*/
 enum {
 	Consumer	= 	0,
@@ -71,25 +200,439 @@ enum {
 };
 
 /*
- * message sent via ring buffer, as header of the payloads
+ * how this peer consumes a channel it is bound to: messages drained by
+ * the tasklet, RPC requests served through IOCTL_RPC_RECV, replies to
+ * the RPCs this peer has called, or messages handed to the receive
+ * callback of another module
+ */
+enum {
+	ChanNone	=	0,
+	ChanMsg		=	1,
+	ChanRpcServer	=	2,
+	ChanRpcClient	=	3,
+	ChanKernel	=	4,
+};
+
+/* what a producer does when a channel has no room for its message */
+enum {
+	PolicyDrop	=	0,
+	PolicyBlock	=	1,
+};
+
+/*
+ * state of a slot in the peer table. A dead slot has no owner anymore,
+ * but the messages it sent stay valid until the slot is claimed again.
+ */
+enum {
+	PeerFree	=	0,
+	PeerAlive	=	1,
+	PeerDead	=	2,
+	PeerClaim	=	3,
+};
+
+/*
+ * doorbell target of a channel, published by the consumer bound to it
+ * @consumer: IVPosition of the consumer peer, RINGBUF_PEER_NONE if unbound
+ * @vector: MSI-X vector of the consumer that serves this channel
+*/
+typedef struct ringbuf_chan_info {
+	unsigned int consumer;
+	unsigned int vector;
+} rbchan_info;
+
+/*
+ * membership record of a peer, on its own cache line since only the
+ * owner writes it while it is alive
+ * @ivposition: IVPosition of the peer owning the slot
+ * @role: Consumer or Producer
+ * @channels: bitmask of the channels it consumes or produces to
+ * @generation: bumped every time the slot is claimed
+ * @heartbeat: bumped by the owner every RINGBUF_HEARTBEAT_MSEC
+ * @stamp: wall clock (ns) of the owner at the last heartbeat
+ * @state: PeerFree, PeerAlive, PeerDead or PeerClaim
+ * @seq: last sequence number sent in each lane of the peer
+ * @arena_pt: next free offset in the payloads slice of each lane
+*/
+typedef struct ringbuf_peer {
+	unsigned int ivposition;
+	unsigned int role;
+	unsigned int channels;
+	unsigned int generation;
+	unsigned int heartbeat;
+	unsigned int state;
+	u64 stamp;
+
+	unsigned int seq[RINGBUF_MAX_CHANNELS];
+	unsigned int arena_pt[RINGBUF_MAX_CHANNELS];
+} ____cacheline_aligned rbpeer;
+
+/*
+ * delivery counters of a channel, as seen by this peer
+ * @chan: channel to query, filled in by the caller of IOCTL_STATS
+ * @drops: messages this producer dropped because the channel was full
+ * @gaps: messages this consumer found missing in a lane
+ * @dups: retransmitted messages this consumer had already consumed
+ * @retransmits: messages this producer sent again after a ring reset
+*/
+typedef struct ringbuf_chan_stats {
+	u32 chan;
+	u64 drops;
+	u64 gaps;
+	u64 dups;
+	u64 retransmits;
+} rbchan_stats;
+
+/*
+ * argument of IOCTL_SEND and IOCTL_RECV, which work on any channel
+ * whatever the role of the device
+ * @len/buf: message to send, or size of the buffer to receive into,
+ *	     set to the length received
+ * @flags: RBIO_NONBLOCK fails a receive with -EAGAIN on an empty ring
+ *	   instead of sleeping, RBIO_RAW receives a compressed payload as
+ *	   it is. Set on return to RBIO_LZ4 or RBIO_ZSTD if it was.
+ * @raw_len: length of the message once decompressed, set on return
+*/
+typedef struct ringbuf_msg_io {
+	u32 chan;
+	u32 len;
+	u64 buf;
+	u32 flags;
+	u32 raw_len;
+} rbmsg_io;
+
+#define RBIO_NONBLOCK		0x01
+#define RBIO_RAW		0x02
+#define RBIO_LZ4		RBMSG_LZ4
+#define RBIO_ZSTD		RBMSG_ZSTD
+
+/*
+ * argument of IOCTL_COMPRESS, how this peer sends to a channel
+ * @algo: CompNone, CompLz4 or CompZstd
+ * @threshold: messages shorter than this are sent as they are
+*/
+typedef struct ringbuf_compress {
+	u32 chan;
+	u32 algo;
+	u32 threshold;
+} rbcompress;
+
+/*
+ * argument of IOCTL_FILE, how an open file of the device reads and
+ * writes. A file starts out on channel 0 both ways with no flags.
+ * @rx_chan: channel of read() and IOCTL_WAIT, bound like IOCTL_RECV
+ * @tx_chan: channel of write()
+ * @flags: RBFILE_WAIT has read() sleep for a message instead of
+ *	   returning 0 on an empty channel, unless the file is O_NONBLOCK,
+ *	   RBFILE_RAW has it return compressed payloads as they are
+*/
+typedef struct ringbuf_file_opts {
+	u32 rx_chan;
+	u32 tx_chan;
+	u32 flags;
+} rbfile_opts;
+
+#define RBFILE_WAIT		0x01
+#define RBFILE_RAW		0x02
+
+/* argument of IOCTL_FILE_STATS, what went through one open file */
+typedef struct ringbuf_file_stats {
+	u64 msgs_sent;
+	u64 bytes_sent;
+	u64 msgs_recv;
+	u64 bytes_recv;
+	u64 full;
+} rbfile_stats;
+
+/*
+ * an open file of the device, in filp->private_data, so that threads
+ * and processes of one VM each read and write with their own settings
+ * @opts: set by IOCTL_FILE, read locklessly by the file operations
+ * @msgs_sent...: counters of rbfile_stats, @full the writes that found
+ *		  the ring full
+*/
+typedef struct ringbuf_file {
+	rbfile_opts	opts;
+	atomic64_t	msgs_sent;
+	atomic64_t	bytes_sent;
+	atomic64_t	msgs_recv;
+	atomic64_t	bytes_recv;
+	atomic64_t	full;
+} rbfile;
+
+/*
+ * argument of the RPC ioctls
+ * @chan: request channel of the service for CALL/SUBMIT, the channel
+ *	  served for RECV, the reply channel for REPLY
+ * @corr_id: out for CALL/SUBMIT/RECV, in for REPLY, in for COMPLETE
+ *	     (0 completes any call)
+ * @reply_chan: out for RECV, where to send the reply
+ * @len/buf: request for CALL/SUBMIT, reply for REPLY
+ * @rlen/rbuf: size of the buffer for the reply (CALL/COMPLETE) or the
+ *	       request (RECV), set to the length received
+*/
+typedef struct ringbuf_rpc {
+	u32 chan;
+	u32 corr_id;
+	u32 reply_chan;
+	u32 len;
+	u64 buf;
+	u32 rlen;
+	u32 pad;
+	u64 rbuf;
+} rbrpc;
+
+/*
+ * hot path counters of this VM, one copy per CPU, summed up by
+ * /proc/ringbuf
+ * @ring_full: sends rejected because the ring or the lane slice was full
+ * @doorbells: doorbells we rang
+ * @drain_msgs/drain_max: messages consumed by the tasklet runs, in total
+ *			  and by the largest run
+ * @lock_contended: publishes that found write_lock taken
+ * @lock_parked: waits for write_lock that outlasted RINGBUF_LOCK_SPIN and
+ *		 parked until the holder rang
+ * @lock_wait_ns/lock_wait_max: time spent waiting for write_lock, in
+ *				total and by the longest wait
+ * @lock_skipped: tickets of dead peers or of nobody we moved past
+ * @comp_msgs/comp_saved: messages sent compressed and the bytes it saved
+ * @decomp_errors: messages received that did not decompress
+ * @combine_runs/combine_msgs: batches of staged writes published by a
+ *			      combiner, and the messages in them
+*/
+typedef struct ringbuf_pcpu_stats {
+	u64 msgs_sent;
+	u64 bytes_sent;
+	u64 msgs_recv;
+	u64 bytes_recv;
+	u64 ring_full;
+	u64 doorbells;
+	u64 interrupts;
+	u64 tasklet_runs;
+	u64 drain_msgs;
+	u64 drain_max;
+	u64 lock_contended;
+	u64 lock_parked;
+	u64 lock_wait_ns;
+	u64 lock_wait_max;
+	u64 lock_skipped;
+	u64 comp_msgs;
+	u64 comp_saved;
+	u64 decomp_errors;
+	u64 combine_runs;
+	u64 combine_msgs;
+} rbpcpu_stats;
+
+/*
+ * a write() staged on its CPU, on the stack of the writer until a
+ * combiner sets @done, with @ret what ringbuf_sendv() returned
+ * @wait: the writer waits for room on a full ring that blocks, its
+ *	  write is then @queued on the backlog, in order
+*/
+typedef struct ringbuf_stage_req {
+	struct list_head list;
+	unsigned int chan;
+	struct kvec iov;
+	ssize_t ret;
+	bool wait;
+	int queued;
+	int done;
+} rbstage_req;
+
+/* the writes staged on one CPU, appended to without any cross-VM atomic */
+typedef struct ringbuf_stage {
+	spinlock_t lock;
+	struct list_head reqs;
+} rbstage;
+
+/*
+ * log-linear latency histogram in ns: values below 2 * RBLAT_SUB exactly,
+ * then RBLAT_SUB buckets per power of two (12.5% wide), up to
+ * 2^RBLAT_MAX_SHIFT ns (about a minute) where everything else lands
+*/
+#define RBLAT_SUB_BITS		3
+#define RBLAT_SUB		(1 << RBLAT_SUB_BITS)
+#define RBLAT_MAX_SHIFT		36
+#define RBLAT_BUCKETS		((RBLAT_MAX_SHIFT - RBLAT_SUB_BITS + 2) * RBLAT_SUB)
+
+enum {
+	LatDequeue	=	0,	/* enqueue to dequeue by the consumer */
+	LatDeliver	=	1,	/* enqueue to copied out to userspace */
+	LatKinds	=	2,
+};
+
+typedef struct ringbuf_lat_hist {
+	u64 count[RBLAT_BUCKETS];
+	u64 max;
+} rblat_hist;
+
+/* the histograms of one channel, one copy per CPU */
+typedef struct ringbuf_lat_chan {
+	rblat_hist kind[LatKinds];
+} rblat_chan;
+
+#define RINGBUF_STAT_INC(f)	this_cpu_inc(ringbuf_pcpu_stats.f)
+#define RINGBUF_STAT_ADD(f, n)	this_cpu_add(ringbuf_pcpu_stats.f, (n))
+
+/*
+ * eventfd registration of a channel, see IOCTL_EVENTFD
+ * @chan: channel to watch
+ * @fd: eventfd to signal, -1 to unregister
+ * @flags: RBEVENT_ARRIVAL to be told about messages landing on a channel
+ *	   we consume, RBEVENT_SPACE about room on a channel we produce to
+ * @threshold: free slots that make a full channel writable again
+*/
+typedef struct ringbuf_event {
+	u32 chan;
+	s32 fd;
+	u32 flags;
+	u32 threshold;
+} rbevent;
+
+#define RBEVENT_ARRIVAL		0x01
+#define RBEVENT_SPACE		0x02
+
+/*
+ * command in the SQE of a RINGBUF_URING_* operation, fits a 64 byte SQE
+ * @chan: channel to send to or receive from
+ * @len/buf: message to send, or buffer to receive into. A batch receive
+ *	     fills the buffer with as many messages as fit, each one
+ *	     preceded by its length on a u32 and padded to 4 bytes.
+*/
+typedef struct ringbuf_uring_cmd {
+	u32 chan;
+	u32 len;
+	u64 buf;
+} rburing_cmd;
+
+/*
+ * an io_uring receive waiting for messages
+ * @kbuf: bounce buffer filled from IVshmem space, copied to the user
+ *	  buffer from the task that submitted the command
+ * @tstamp: send time of the oldest message in @kbuf
+ * @filp: file the command was submitted on, its release fails the
+ *	  receives still queued
+*/
+typedef struct ringbuf_uring_req {
+	struct list_head list;
+	struct io_uring_cmd *ioucmd;
+	struct file *filp;
+	unsigned int op;
+	unsigned int chan;
+	u64 ubuf;
+	u32 len;
+	char *kbuf;
+	ssize_t res;
+	u64 tstamp;
+} rburing_req;
+
+/*
+ * a message the tasklet moved out of the ring of a ChanMsg channel,
+ * waiting in the delivery queue of the channel to be read
+ * @hd: its header as it was in the ring
+ * @data: its payload as it was in the ring, compressed or not
+*/
+typedef struct ringbuf_deliv_msg {
+	struct list_head list;
+	rbmsg_hd hd;
+	char data[];
+} rbdeliv_msg;
+
+/* peer slot of the messages that come from a delivery queue */
+#define RINGBUF_SLOT_QUEUED	RINGBUF_MAX_PEERS
+
+/*
+ * an RPC waiting for its reply
+ * @sync: a blocking call, which IOCTL_RPC_COMPLETE must leave alone
+ * @rep/rep_len: reply, once @done
 */
-typedef struct ringbuf_msg_hd {
-	unsigned int src_qid;
+typedef struct ringbuf_rpc_call {
+	struct list_head list;
+	unsigned int corr_id;
+	bool sync;
+	bool done;
+	char *rep;
+	size_t rep_len;
+} rbrpc_call;
 
-	unsigned int payload_off;
-	ssize_t payload_len;
-} rbmsg_hd;
+/*
+ * superblock at the start of IVshmem space, shared by all peers
+ * @generation: bumped every time the layout is formatted
+ * @lock_owner: IVPosition of the peer holding write_lock
+ * @write_lock: multiple writer lock, taken by the producers of all peers
+*/
+typedef struct ringbuf_super {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int generation;
+	unsigned int nchannels;
+	unsigned int lock_owner;
 
-typedef STRUCT_KFIFO(char, RINGBUF_SZ) fifo;
+	rbchan_info chan[RINGBUF_MAX_CHANNELS];
+	rbpeer peers[RINGBUF_MAX_PEERS];
+
+	rblock write_lock;
+} rbsuper;
 
 /*
  * @ivposition: device ID in IVshmem
  * @regaddr: physical address of shmem PCIe dev regs
- * @base_addr: mapped start address of IVshmem space
+ * @base_addr: mapped start address of IVshmem space, write-back cached:
+ *	       it is plain RAM of the host, coherent between the VMs
  * @bar#_addr/size: address or size of IVshmem BAR
- * @fifo_addr: address of the Kfifo struct
+ * @super: superblock at the start of IVshmem space
+ * @rings: rings of message headers, one per channel
+ * @generation: superblock generation this peer attached under
  * @payloads_st: start address of the payloads area
+ * @arena_sz: size of the payloads slice owned by each peer slot, split
+ *	      in one lane slice per channel
  * write_lock: multiple writer lock
+ * @lock_kick: set by the interrupt handler, a parked write_lock waiter
+ *	       watches it instead of the lock in IVshmem space
+ * @peer_slot: index of this peer in the peer table
+ * @hb_seen/hb_jiffies: last heartbeat seen of each peer, and when
+ * @lane_lock: serialises local writers on the state of our lanes
+ * @lock_batch: write_lock is held across a batch of publishes, under
+ *		lane_lock
+ * @lock_ticket: our ticket of write_lock while we hold it, under lane_lock
+ * @stage_backlog: staged writes waiting for room on a full ring, ahead
+ *		   of what is staged after them, under lane_lock
+ * @window: unacked messages of each of our lanes, as a producer
+ * @fence/fence_epoch/fenced: lanes a previous incarnation of this peer
+ *			     left unacked messages in, which our window
+ *			     does not know of: nothing is sent to them until
+ *			     the consumer acked up to fence, or the ring was
+ *			     formatted since fence_epoch, under lane_lock
+ * @expect/@expect_gen: next sequence number expected in each lane and
+ *			the generation of its producer, as a consumer
+ * @stats: delivery counters of each channel
+ * @chan_mode: how we consume each channel, ChanNone if we do not
+ * @rpc_reply_chan: channel on which we receive RPC replies, or -1
+ * @rpc_corr: last correlation ID used
+ * @rpc_calls: RPCs waiting for a reply or for IOCTL_RPC_COMPLETE
+ * @recv_lock: serialises consumers of our channels, the tasklet against
+ *	       read() and friends
+ * @uring_recv: io_uring receives waiting for messages, per channel
+ * @deliv/deliv_bytes: messages of each ChanMsg channel the tasklet took
+ *		      out of the ring ahead of its readers, and their
+ *		      payload bytes, under recv_lock
+ * @ev_lock: protects the eventfds, taken from the interrupt handler
+ * @ev_arrival: signaled by the tasklet when a consumed channel has messages
+ * @ev_space: signaled by the interrupt handler when a produced channel
+ *	      has ev_space_thresh free slots again
+ * @ev_space_armed: channels seen below their threshold since last signaled
+ * @comp_algo/comp_threshold: how we compress what we send to each channel
+ * @comp_wrkmem: compression state, under lane_lock
+ * @decomp_wrkmem: decompression state, under recv_lock
+ * @decomp_buf: a lane slice worth of room to decompress into, under
+ *		recv_lock, for receive buffers shorter than the message
+ * @copy: copy engines of the payloads, see ringbuf_copy.h
+ * @pf_slot/pf_payload: next slot of each channel whose slot or whose
+ *			payload the consumer has not prefetched yet, under
+ *			recv_lock
+ * @kchan/kchan_mask: handle of the module receiving each ChanKernel
+ *		     channel, and which have one, under recv_lock
+ * @kspace/kspace_armed: handle told when each channel has room again, and
+ *			which channels it found full, under ev_lock
 */
 
 typedef struct ringbuf_device {
@@ -100,7 +643,7 @@ typedef struct ringbuf_device {
 	unsigned int 	ivposition;
 
 	void __iomem 	*regs_addr;
-	void __iomem 	*base_addr;
+	void 		*base_addr;
 
 	unsigned int 	bar0_addr;
 	unsigned int 	bar0_size;
@@ -113,14 +656,87 @@ typedef struct ringbuf_device {
 	unsigned int 	bar2_addr;
 	unsigned int 	bar2_size;
 
-	fifo*		fifo_addr;
-	unsigned int 	bufsize;
-	void __iomem	*payloads_st;
-	spinlock_t	*write_lock;
+	rbsuper		*super;
+	void		*rings;
+	unsigned int	generation;
+	void		*payloads_st;
+	unsigned int	arena_sz;
+	rblock		*write_lock;
+	unsigned int	lock_kick;
 	
 	unsigned int 	role;
+
+	int		peer_slot;
+	unsigned int	hb_seen[RINGBUF_MAX_PEERS];
+	unsigned long	hb_jiffies[RINGBUF_MAX_PEERS];
+
+	spinlock_t	lane_lock;
+	bool		lock_batch;
+	unsigned int	lock_ticket;
+	struct list_head stage_backlog;
+	rbwindow	window[RINGBUF_MAX_CHANNELS];
+	unsigned int	fence[RINGBUF_MAX_CHANNELS];
+	unsigned int	fence_epoch[RINGBUF_MAX_CHANNELS];
+	unsigned long	fenced;
+	unsigned int	expect[RINGBUF_MAX_PEERS][RINGBUF_MAX_CHANNELS];
+	unsigned int	expect_gen[RINGBUF_MAX_PEERS];
+	rbchan_stats	stats[RINGBUF_MAX_CHANNELS];
+
+	unsigned int	chan_mode[RINGBUF_MAX_CHANNELS];
+	int		rpc_reply_chan;
+	atomic_t	rpc_corr;
+	spinlock_t	rpc_lock;
+	struct list_head rpc_calls;
+
+	spinlock_t	recv_lock;
+	struct list_head uring_recv[RINGBUF_MAX_CHANNELS];
+	struct list_head deliv[RINGBUF_MAX_CHANNELS];
+	size_t		deliv_bytes[RINGBUF_MAX_CHANNELS];
+
+	spinlock_t	ev_lock;
+	struct eventfd_ctx *ev_arrival[RINGBUF_MAX_CHANNELS];
+	struct eventfd_ctx *ev_space[RINGBUF_MAX_CHANNELS];
+	unsigned int	ev_space_thresh[RINGBUF_MAX_CHANNELS];
+	unsigned long	ev_space_armed;
+
+	unsigned int	comp_algo[RINGBUF_MAX_CHANNELS];
+	unsigned int	comp_threshold[RINGBUF_MAX_CHANNELS];
+	void		*lz4_wrkmem;
+	void		*zstd_wrkmem;
+#ifdef RINGBUF_ZSTD
+	zstd_cctx	*zstd_cctx;
+	zstd_dctx	*zstd_dctx;
+	zstd_parameters	zstd_params;
+#endif
+	void		*zstd_dwrkmem;
+	char		*decomp_buf;
+
+	rbcopy		copy;
+
+	unsigned int	pf_slot[RINGBUF_MAX_CHANNELS];
+	unsigned int	pf_payload[RINGBUF_MAX_CHANNELS];
+
+	struct ringbuf_chan *kchan[RINGBUF_MAX_CHANNELS];
+	unsigned long	kchan_mask;
+	struct ringbuf_chan *kspace[RINGBUF_MAX_CHANNELS];
+	unsigned long	kspace_armed;
 } ringbuf_device;
 
+/*
+ * a channel opened by another module, see ringbuf.h
+ * @recv/priv: callback of the messages of the channel, once it receives
+ * @arrival/space: callbacks of ringbuf_chan_notify(), with priv too
+ * @prev_mode: how the channel was consumed before, restored at close
+*/
+struct ringbuf_chan {
+	unsigned int	chan;
+	ringbuf_recv_fn	recv;
+	ringbuf_notify_fn arrival;
+	ringbuf_notify_fn space;
+	void		*priv;
+	unsigned int	prev_mode;
+};
+
 
 static int __init ringbuf_init(void);
 static void __exit ringbuf_cleanup(void);
@@ -132,18 +748,57 @@ static void ringbuf_remove_device(struct pci_dev* pdev);
 static int ringbuf_probe_device(struct pci_dev *pdev,
 				const struct pci_device_id * ent);
 static long ringbuf_ioctl(struct file *fp, unsigned int cmd,  long unsigned int value);
+static __poll_t ringbuf_fpoll(struct file *fp, poll_table *wait);
 static void ringbuf_poll(struct work_struct *work);
 static void ringbuf_notify(unsigned int value);
+static void ringbuf_lock_pass(unsigned int ticket);
 static void ringbuf_readmsg(struct tasklet_struct* data);
+static void ringbuf_kick(unsigned int chan);
+static void ringbuf_doorbell(unsigned int ivposition, unsigned int vector);
+static int ringbuf_attach(void);
+static inline rbring *ringbuf_ring(unsigned int chan);
+static inline bool ringbuf_readable(unsigned int chan);
+static int ringbuf_stats_show(struct seq_file *m, void *v);
+static void ringbuf_retransmit(unsigned int chan);
+static int ringbuf_chan_bind(unsigned int chan, unsigned int mode);
+static long ringbuf_rpc_ioctl(unsigned int cmd, rbrpc __user *arg);
+static void ringbuf_rpc_complete(unsigned int chan);
+static ssize_t ringbuf_recv(unsigned int chan, char *buffer, size_t len,
+				rbmsg_hd *hd, bool raw);
+static long ringbuf_compress_ioctl(rbcompress __user *uarg);
+static int ringbuf_comp_init(void);
+static void ringbuf_comp_exit(void);
+static void ringbuf_lat_record(unsigned int chan, int kind, u64 tstamp);
+static void ringbuf_uring_drain(unsigned int chan);
+static void ringbuf_deliver(unsigned int chan);
+static void ringbuf_kchan_drain(unsigned int chan);
+static void ringbuf_kchan_space(void);
+static long ringbuf_event_register(rbevent __user *arg);
+static long ringbuf_msg_ioctl(rbfile *f, unsigned int cmd,
+				rbmsg_io __user *arg);
+static long ringbuf_file_ioctl(rbfile *f, unsigned int cmd,
+				unsigned long arg);
+static bool ringbuf_event_arrival(unsigned int chan);
+static void ringbuf_event_space(unsigned int chan);
+#ifdef RINGBUF_URING_CMD
+static int ringbuf_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
 
 static int event_toggle;
 DECLARE_WAIT_QUEUE_HEAD(wait_queue);
+DECLARE_WAIT_QUEUE_HEAD(rpc_wait);
+
+static struct workqueue_struct *poll_workqueue;
+static DECLARE_DELAYED_WORK(poll_work, ringbuf_poll);
 
 DECLARE_TASKLET(read_msg_tasklet, ringbuf_readmsg);
 
 static ringbuf_device ringbuf_dev;
-static unsigned int payload_pt;
 static int device_major_nr;
+static DEFINE_PER_CPU(rbpcpu_stats, ringbuf_pcpu_stats);
+static DEFINE_PER_CPU(rbstage, ringbuf_stage);
+static rblat_chan __percpu *ringbuf_lat[RINGBUF_MAX_CHANNELS];
+static struct dentry *ringbuf_debugfs;
 
 
 static const struct file_operations ringbuf_ops = {
@@ -152,7 +807,11 @@ static const struct file_operations ringbuf_ops = {
 	.read		= 	ringbuf_read,
 	.write   	= 	ringbuf_write,
 	.release 	= 	ringbuf_release,
+	.poll		=	ringbuf_fpoll,
 	.unlocked_ioctl   = 	ringbuf_ioctl,
+#ifdef RINGBUF_URING_CMD
+	.uring_cmd	=	ringbuf_uring_cmd,
+#endif
 };
 
 static struct pci_device_id ringbuf_id_table[] = {
@@ -173,6 +832,10 @@ static long ringbuf_ioctl(struct file *fp, unsigned int cmd,  long unsigned int
 {
     	unsigned int ivposition;
     	unsigned int vector;
+	unsigned int chan;
+	rbchan_stats stats;
+	rbfile *f;
+	long ret;
 
 	ringbuf_device *dev = &ringbuf_dev;
     	BUG_ON(dev->base_addr == NULL);
@@ -181,19 +844,75 @@ static long ringbuf_ioctl(struct file *fp, unsigned int cmd,  long unsigned int
     	case IOCTL_RING:
         	vector = value & 0xffff;
         	ivposition = (value & 0xffff0000) >> 16;
-
-        	writel(value & 0xffffffff, dev->regs_addr + DOORBELL_REG_OFF);
+		ringbuf_doorbell(ivposition, vector);
         break;
 
+	/* sleep until the rx channel has a message, at most value ms if not 0 */
 	case IOCTL_WAIT:
-		printk(KERN_INFO "wait for interrupt\n");
-		// todo: poll
-		return 0;
+		f = fp->private_data;
+		chan = READ_ONCE(f->opts.rx_chan);
+		if (value == 0)
+			return wait_event_interruptible(wait_queue,
+					ringbuf_readable(chan));
+		ret = wait_event_interruptible_timeout(wait_queue,
+				ringbuf_readable(chan), msecs_to_jiffies(value));
+		if (ret < 0)
+			return ret;
+		return ret ? 0 : -ETIMEDOUT;
 
 	case IOCTL_IVPOSITION:
 		printk(KERN_INFO "get ivposition: %u\n", dev->ivposition);
 		return dev->ivposition;
 
+	/* channel in the high half, PolicyDrop or PolicyBlock in the low */
+	case IOCTL_POLICY:
+		chan = (value & 0xffff0000) >> 16;
+		if (chan >= RINGBUF_MAX_CHANNELS || (value & 0xffff) > PolicyBlock)
+			return -EINVAL;
+		WRITE_ONCE(ringbuf_ring(chan)->policy, value & 0xffff);
+		break;
+
+	case IOCTL_STATS:
+		if (copy_from_user(&stats, (void __user *)value, sizeof(stats)))
+			return -EFAULT;
+		if (stats.chan >= RINGBUF_MAX_CHANNELS)
+			return -EINVAL;
+		if (copy_to_user((void __user *)value, &dev->stats[stats.chan],
+							sizeof(stats)))
+			return -EFAULT;
+		break;
+
+	/* channel in the high half, ChanRpcServer or ChanRpcClient in the low */
+	case IOCTL_RPC_BIND:
+		chan = (value & 0xffff0000) >> 16;
+		if (chan >= RINGBUF_MAX_CHANNELS ||
+		    ((value & 0xffff) != ChanRpcServer &&
+		     (value & 0xffff) != ChanRpcClient))
+			return -EINVAL;
+		return ringbuf_chan_bind(chan, value & 0xffff);
+
+	case IOCTL_RPC_CALL:
+	case IOCTL_RPC_SUBMIT:
+	case IOCTL_RPC_COMPLETE:
+	case IOCTL_RPC_RECV:
+	case IOCTL_RPC_REPLY:
+		return ringbuf_rpc_ioctl(cmd, (rbrpc __user *)value);
+
+	case IOCTL_EVENTFD:
+		return ringbuf_event_register((rbevent __user *)value);
+
+	case IOCTL_SEND:
+	case IOCTL_RECV:
+		return ringbuf_msg_ioctl(fp->private_data, cmd,
+					(rbmsg_io __user *)value);
+
+	case IOCTL_COMPRESS:
+		return ringbuf_compress_ioctl((rbcompress __user *)value);
+
+	case IOCTL_FILE:
+	case IOCTL_FILE_STATS:
+		return ringbuf_file_ioctl(fp->private_data, cmd, value);
+
 	default:
 		printk(KERN_INFO "bad ioctl command: %d\n", cmd);
 		return -1;
@@ -202,18 +921,375 @@ static long ringbuf_ioctl(struct file *fp, unsigned int cmd,  long unsigned int
 	return 0;
 }
 
+/*
+ * slot of a peer in the peer table, alive or dead, or -1 if it has none
+ */
+static int ringbuf_peer_lookup(unsigned int ivposition)
+{
+	rbpeer *peer;
+	unsigned int state;
+	int i;
+
+	for (i = 0; i < RINGBUF_MAX_PEERS; i++) {
+		peer = &ringbuf_dev.super->peers[i];
+		state = READ_ONCE(peer->state);
+		if ((state == PeerAlive || state == PeerDead) &&
+		    READ_ONCE(peer->ivposition) == ivposition)
+			return i;
+	}
+
+	return -1;
+}
+
+static bool ringbuf_peer_alive(unsigned int ivposition)
+{
+	int slot = ringbuf_peer_lookup(ivposition);
+
+	return slot >= 0 &&
+		READ_ONCE(ringbuf_dev.super->peers[slot].state) == PeerAlive;
+}
+
+/*
+ * a message is valid as long as the slot of its producer has not been
+ * claimed by somebody else since it was sent
+ */
+static bool ringbuf_peer_valid(unsigned int ivposition, unsigned int gen)
+{
+	int slot = ringbuf_peer_lookup(ivposition);
+
+	return slot >= 0 &&
+		READ_ONCE(ringbuf_dev.super->peers[slot].generation) == gen;
+}
+
+static bool ringbuf_peer_claim(int slot, unsigned int state)
+{
+	return cmpxchg(&ringbuf_dev.super->peers[slot].state, state,
+			PeerClaim) == state;
+}
+
+/*
+ * claim a slot in the peer table, held as PeerClaim while it is filled.
+ * A peer coming back with the same IVPosition (module reload) takes its
+ * own slot back and keeps its generation, so that the messages it left
+ * in the rings stay valid. Otherwise a free slot is preferred over the
+ * slot of a dead peer, whose leftover messages are then invalidated.
+ */
+static int ringbuf_peer_attach(void)
+{
+	rbsuper *super = ringbuf_dev.super;
+	rbpeer *peer;
+	bool fresh;
+	int i, slot;
+
+	slot = ringbuf_peer_lookup(ringbuf_dev.ivposition);
+	if (slot >= 0 && !ringbuf_peer_claim(slot,
+				READ_ONCE(super->peers[slot].state)))
+		slot = -1;
+
+	fresh = slot < 0;
+
+	for (i = 0; slot < 0 && i < RINGBUF_MAX_PEERS; i++)
+		if (ringbuf_peer_claim(i, PeerFree))
+			slot = i;
+	for (i = 0; slot < 0 && i < RINGBUF_MAX_PEERS; i++)
+		if (ringbuf_peer_claim(i, PeerDead))
+			slot = i;
+
+	if (slot < 0) {
+		printk(KERN_ERR "ringbuf: peer table is full\n");
+		return -ENOSPC;
+	}
+
+	peer = &super->peers[slot];
+	peer->ivposition = ringbuf_dev.ivposition;
+	peer->role = ringbuf_dev.role;
+	peer->channels = 0;
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++)
+		if (ringbuf_dev.chan_mode[i] != ChanNone)
+			peer->channels |= 1 << i;
+	peer->heartbeat = 0;
+	peer->stamp = ktime_get_real_ns();
+	if (fresh) {
+		peer->generation++;
+		for (i = 0; i < RINGBUF_MAX_CHANNELS; i++) {
+			peer->seq[i] = 0;
+			peer->arena_pt[i] = 0;
+			ringbuf_ring(i)->ack[slot] = 0;
+		}
+	}
+
+	/* payloads of our last incarnation the consumers still have to read */
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	for (i = 0; fresh && i < RINGBUF_MAX_CHANNELS; i++) {
+		/* they were in the slice of a slot that is not ours anymore */
+		ringbuf_dev.window[i].first = ringbuf_dev.window[i].last;
+		clear_bit(i, &ringbuf_dev.fenced);
+	}
+	for (i = 0; !fresh && i < RINGBUF_MAX_CHANNELS; i++) {
+		if (ringbuf_dev.window[i].first != ringbuf_dev.window[i].last ||
+		    READ_ONCE(ringbuf_ring(i)->ack[slot]) == peer->seq[i])
+			continue;
+		ringbuf_dev.fence[i] = peer->seq[i];
+		ringbuf_dev.fence_epoch[i] = READ_ONCE(ringbuf_ring(i)->epoch);
+		set_bit(i, &ringbuf_dev.fenced);
+		printk(KERN_INFO "lane %u: waiting for msgs up to seq %u to be acked\n",
+			i, peer->seq[i]);
+	}
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	wmb();
+	WRITE_ONCE(peer->state, PeerAlive);
+
+	ringbuf_dev.peer_slot = slot;
+	printk(KERN_INFO "%s peer slot %d, generation %u\n",
+		fresh ? "attached as" : "reattached to", slot, peer->generation);
+
+	return 0;
+}
+
+/*
+ * leave the slot dead rather than free, the messages we sent are still
+ * to be consumed and we may come back to it
+ */
+static void ringbuf_peer_detach(void)
+{
+	if (ringbuf_dev.peer_slot < 0)
+		return;
+
+	WRITE_ONCE(ringbuf_dev.super->peers[ringbuf_dev.peer_slot].state,
+			PeerDead);
+	ringbuf_dev.peer_slot = -1;
+}
+
+/*
+ * release the channels a dead peer consumed. Its slot, hence its
+ * payloads slice, stays as it is until claimed again.
+ */
+static void ringbuf_peer_reclaim(int slot)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int ivposition = READ_ONCE(super->peers[slot].ivposition);
+	unsigned int i;
+
+	printk(KERN_WARNING "ringbuf: peer %u (slot %d) is dead, reclaiming\n",
+		ivposition, slot);
+
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++)
+		cmpxchg(&super->chan[i].consumer, ivposition,
+				RINGBUF_PEER_NONE);
+}
+
+/*
+ * take write_lock away from a dead peer. A peer declared dead may only
+ * be stalled, and still publishes until it sees its ticket is not
+ * served anymore, so this waits for RINGBUF_LOCK_BREAK_MSEC without a
+ * heartbeat, well past RINGBUF_PEER_TIMEOUT_MSEC.
+ */
+static void ringbuf_peer_break_lock(int slot)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int ivposition = READ_ONCE(super->peers[slot].ivposition);
+	unsigned int ticket;
+
+	ticket = READ_ONCE(super->write_lock.ticket[slot]);
+	if (ticket == RBLOCK_NONE ||
+	    ticket != READ_ONCE(super->write_lock.serving))
+		return;
+
+	if (rblock_skip(&super->write_lock, slot, ticket)) {
+		printk(KERN_WARNING "ringbuf: breaking write lock of peer %u\n",
+			ivposition);
+		cmpxchg(&super->lock_owner, ivposition, RINGBUF_PEER_NONE);
+		RINGBUF_STAT_INC(lock_skipped);
+		ringbuf_lock_pass(ticket + RBLOCK_STEP);
+	}
+}
+
+/*
+ * stop sending from our slot, then attach again and take our channels
+ * back. The slot is ours again if nobody claimed it meanwhile.
+ */
+static void ringbuf_reattach(void)
+{
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	ringbuf_dev.peer_slot = -1;
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	ringbuf_attach();
+}
+
+/*
+ * make sure we are still alive in our slot, bump our own heartbeat,
+ * then look for peers whose heartbeat has not moved for
+ * RINGBUF_PEER_TIMEOUT_MSEC, and dead ones still holding write_lock
+ * after RINGBUF_LOCK_BREAK_MSEC. Guest clocks are not synced, so
+ * staleness is judged on our own jiffies, not on the peer's stamp.
+ */
+static void ringbuf_peer_scan(void)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned long timeout = msecs_to_jiffies(RINGBUF_PEER_TIMEOUT_MSEC);
+	unsigned long grace = msecs_to_jiffies(RINGBUF_LOCK_BREAK_MSEC);
+	unsigned int hb, state;
+	rbpeer *peer;
+	int i;
+
+	/* a stall longer than the timeout got us declared dead */
+	if (ringbuf_dev.peer_slot >= 0) {
+		peer = &super->peers[ringbuf_dev.peer_slot];
+		if (READ_ONCE(peer->state) != PeerAlive ||
+		    READ_ONCE(peer->ivposition) != ringbuf_dev.ivposition) {
+			printk(KERN_WARNING "ringbuf: declared dead by a peer, reattaching\n");
+			ringbuf_reattach();
+		}
+	}
+
+	if (ringbuf_dev.peer_slot >= 0) {
+		peer = &super->peers[ringbuf_dev.peer_slot];
+		peer->stamp = ktime_get_real_ns();
+		wmb();
+		WRITE_ONCE(peer->heartbeat, peer->heartbeat + 1);
+	}
+
+	for (i = 0; i < RINGBUF_MAX_PEERS; i++) {
+		peer = &super->peers[i];
+		state = READ_ONCE(peer->state);
+		if (i == ringbuf_dev.peer_slot ||
+		    (state != PeerAlive && state != PeerDead))
+			continue;
+
+		hb = READ_ONCE(peer->heartbeat);
+		if (hb != ringbuf_dev.hb_seen[i] || !ringbuf_dev.hb_jiffies[i]) {
+			ringbuf_dev.hb_seen[i] = hb;
+			ringbuf_dev.hb_jiffies[i] = jiffies;
+			continue;
+		}
+
+		if (state == PeerDead) {
+			if (time_after_eq(jiffies, ringbuf_dev.hb_jiffies[i] + grace))
+				ringbuf_peer_break_lock(i);
+			continue;
+		}
+
+		if (time_before(jiffies, ringbuf_dev.hb_jiffies[i] + timeout))
+			continue;
+
+		if (cmpxchg(&peer->state, PeerAlive, PeerDead) == PeerAlive)
+			ringbuf_peer_reclaim(i);
+	}
+}
+
+static void ringbuf_poll(struct work_struct *work)
+{
+	unsigned int chan;
+
+	if (READ_ONCE(ringbuf_dev.super->generation) != ringbuf_dev.generation) {
+		printk(KERN_WARNING "ringbuf: layout formatted again, reattaching\n");
+		ringbuf_reattach();
+	}
+
+	ringbuf_peer_scan();
+
+	if (ringbuf_dev.peer_slot >= 0) {
+		spin_lock_bh(&ringbuf_dev.lane_lock);
+		for (chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++)
+			ringbuf_retransmit(chan);
+		spin_unlock_bh(&ringbuf_dev.lane_lock);
+	}
+	ringbuf_kchan_space();
+
+	queue_delayed_work(poll_workqueue, &poll_work,
+			msecs_to_jiffies(RINGBUF_HEARTBEAT_MSEC));
+}
+
+/*
+ * wake the producers blocked on a full ring, on their first vector
+ */
+static void ringbuf_kick_waiters(rbring *ring)
+{
+	unsigned long waiters;
+	unsigned int ivposition;
+	int slot;
+
+	if (!READ_ONCE(ring->waiters))
+		return;
+
+	waiters = xchg(&ring->waiters, 0);
+	for_each_set_bit(slot, &waiters, RINGBUF_MAX_PEERS) {
+		ivposition = READ_ONCE(ringbuf_dev.super->peers[slot].ivposition);
+		if (ringbuf_peer_alive(ivposition))
+			ringbuf_doorbell(ivposition, 0);
+	}
+}
+
+/* ring vector of peer ivposition */
+static void ringbuf_doorbell(unsigned int ivposition, unsigned int vector)
+{
+	writel(DOORBELL_VAL(ivposition, vector),
+			ringbuf_dev.regs_addr + DOORBELL_REG_OFF);
+	RINGBUF_STAT_INC(doorbells);
+	trace_ringbuf_doorbell(ivposition, vector);
+}
+
+/*
+ * ring the doorbell of the consumer bound to a channel, on the vector
+ * it has published for that channel. Nobody is woken if the channel
+ * has no consumer yet.
+ */
+static void ringbuf_kick(unsigned int chan)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int consumer, vector;
+
+	if (unlikely(super == NULL || chan >= RINGBUF_MAX_CHANNELS))
+		return;
+
+	consumer = READ_ONCE(super->chan[chan].consumer);
+	vector = READ_ONCE(super->chan[chan].vector);
+	if (consumer == RINGBUF_PEER_NONE || !ringbuf_peer_alive(consumer))
+		return;
+
+	ringbuf_doorbell(consumer, vector);
+}
+
+/*
+ * the tasklet has work whatever our role: a channel we consume, in any
+ * mode, or an RPC waiting for its reply
+ */
+static bool ringbuf_consuming(struct ringbuf_device *dev)
+{
+	unsigned int chan;
+
+	for (chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++)
+		if (READ_ONCE(dev->chan_mode[chan]) != ChanNone)
+			return true;
+
+	return !list_empty(&dev->rpc_calls);
+}
+
 /* 
  * interrupt handler, to receive message
  */
 static irqreturn_t ringbuf_interrupt (int irq, void *dev_instance)
 {
 	struct ringbuf_device * dev = dev_instance;
+	unsigned int chan;
 
 	if (unlikely(dev == NULL))
 		return IRQ_NONE;
 
-	// printk(KERN_INFO "RINGBUF: interrupt: %d\n", irq);
-	tasklet_schedule(&read_msg_tasklet);
+	RINGBUF_STAT_INC(interrupts);
+	trace_ringbuf_interrupt(irq);
+	WRITE_ONCE(dev->lock_kick, 1);
+	if (ringbuf_consuming(dev))
+		tasklet_schedule(&read_msg_tasklet);
+
+	/* producers are rung back when a full ring has room again */
+	wake_up_interruptible(&wait_queue);
+	ringbuf_kchan_space();
+	if (dev->ev_space_armed)
+		for (chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++)
+			ringbuf_event_space(chan);
 
 	return IRQ_HANDLED;
 }
@@ -225,7 +1301,6 @@ static int request_msix_vectors(struct ringbuf_device *dev, int n)
 	ret = -EINVAL;
 
 	printk(KERN_INFO "request msi-x vectors: %d\n", n);
-	dev->nvectors = n;
 
 	dev->msix_names = kmalloc(n * sizeof(*dev->msix_names), GFP_KERNEL);
 	if (dev->msix_names == NULL) {
@@ -238,6 +1313,7 @@ static int request_msix_vectors(struct ringbuf_device *dev, int n)
 		printk(KERN_INFO "Fail to alloc pci MSI-X irq\n");
 		goto free_names;
 	}
+	dev->nvectors = alloc_nums;
 
 	for (i = 0; i < alloc_nums; i++) {
 		snprintf(dev->msix_names[i], sizeof(*dev->msix_names),
@@ -260,6 +1336,9 @@ static int request_msix_vectors(struct ringbuf_device *dev, int n)
 	return 0;
 
 release_irqs:
+	while (i--)
+		free_irq(pci_irq_vector(dev->dev, i), dev);
+	dev->nvectors = 0;
     	pci_free_irq_vectors(dev->dev);
 
 free_names:
@@ -269,138 +1348,2634 @@ error:
     	return ret;
 }
 
-static void ringbuf_fifo_init(void) 
+/*
+ * MSI-X vector on which this peer serves a channel, channels are spread
+ * over the allocated vectors so that each one can be steered to a CPU
+ */
+static inline unsigned int ringbuf_chan_vector(unsigned int chan)
 {
-	fifo fifo_indevice;
-	spinlock_t lock;
-
-	printk(KERN_INFO "Check if the ring buffer is already init");
-	if(kfifo_size(ringbuf_dev.fifo_addr) != RINGBUF_SZ) {
-		printk(KERN_INFO "Start to init the ring buffer\n");
+	return chan % MAX(ringbuf_dev.nvectors, 1);
+}
 
-		memcpy(ringbuf_dev.fifo_addr, &fifo_indevice, 
-					sizeof(fifo_indevice));
-		INIT_KFIFO(*(ringbuf_dev.fifo_addr));
+/*
+ * format the superblock on first use, then publish this peer as the
+ * consumer of channel 0 if it is a reader.
+ */
+static void ringbuf_super_init(void)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int i;
 
-		memcpy(ringbuf_dev.write_lock, &lock, sizeof(lock));
-		spin_lock_init(ringbuf_dev.write_lock);
-	}
+	BUILD_BUG_ON(sizeof(rbsuper) > RINGBUF_SUPER_SZ);
+	BUILD_BUG_ON(sizeof(rbslot) != 64);
 
-	printk(KERN_INFO "Check if the payloads area is already init");
-	//TODO: init the payloads linklist
-	payload_pt = 0;
-}
+	if (READ_ONCE(super->magic) != RINGBUF_MAGIC ||
+	    READ_ONCE(super->version) != RINGBUF_VERSION) {
+		printk(KERN_INFO "Start to init the superblock\n");
 
-static void free_msix_vectors(struct ringbuf_device *dev)
-{
-	pci_free_irq_vectors(dev->dev);
-	kfree(dev->msix_names);
-}
+		WRITE_ONCE(super->magic, 0);
+		wmb();
+		super->generation++;
+		memset(super->peers, 0, sizeof(super->peers));
+		for (i = 0; i < RINGBUF_MAX_CHANNELS; i++) {
+			super->chan[i].consumer = RINGBUF_PEER_NONE;
+			super->chan[i].vector = 0;
+		}
+		super->nchannels = 1;
+		super->lock_owner = RINGBUF_PEER_NONE;
+		rblock_init(&super->write_lock);
+		super->version = RINGBUF_VERSION;
 
-static void ringbuf_readmsg(struct tasklet_struct* data)
-{
-	char recv[512];
+		wmb();
+		WRITE_ONCE(super->magic, RINGBUF_MAGIC);
+	}
 
-	ringbuf_read(NULL, recv, 512, 0);
-	printk(KERN_INFO "recv msg: %s\n", recv);
+	/* channels we consumed before the layout was formatted again */
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++)
+		if (ringbuf_dev.chan_mode[i] != ChanNone)
+			ringbuf_chan_bind(i, ringbuf_dev.chan_mode[i]);
 }
 
-static ssize_t ringbuf_read(struct file * filp, char * buffer, size_t len, 
-							loff_t *offset)
+/*
+ * publish this peer as the consumer of a channel. A channel is taken
+ * over from a previous consumer, which is how a restarted consumer
+ * gets its channel back under a new IVPosition.
+ */
+static int ringbuf_chan_bind(unsigned int chan, unsigned int mode)
 {
-	rbmsg_hd hd;
-	unsigned int msgread_len;
-	fifo *fifo_addr = ringbuf_dev.fifo_addr;
+	rbsuper *super = ringbuf_dev.super;
 
-	/* if the device role is not Consumer, than not allowed to read */
-	if(ringbuf_dev.role != Consumer) {
-		printk(KERN_ERR "ringbuf: not allowed to read \n");
-		return 0;
-	}
-	if(!ringbuf_dev.base_addr || !fifo_addr) {
-		printk(KERN_ERR "ringbuf: cannot read from addr (NULL)\n");
-		return 0;
-	}
+	if (mode == ChanRpcClient && ringbuf_dev.rpc_reply_chan >= 0 &&
+	    ringbuf_dev.rpc_reply_chan != chan)
+		return -EBUSY;
 
-	if(kfifo_len(fifo_addr) < RINGBUF_MSG_SZ) {
-		printk(KERN_ERR "no msg in ring buffer\n");
-		return 0;
-	}
+	super->chan[chan].vector = ringbuf_chan_vector(chan);
+	wmb();
+	WRITE_ONCE(super->chan[chan].consumer, ringbuf_dev.ivposition);
 
-	fifo_addr->kfifo.data = (void*)fifo_addr + 0x18;
+	ringbuf_dev.chan_mode[chan] = mode;
+	if (mode == ChanRpcClient)
+		ringbuf_dev.rpc_reply_chan = chan;
+	if (ringbuf_dev.peer_slot >= 0)
+		super->peers[ringbuf_dev.peer_slot].channels |= 1 << chan;
 
-	mb();
+	printk(KERN_INFO "consumer of channel %u: peer %u vector %u mode %u\n",
+		chan, ringbuf_dev.ivposition, super->chan[chan].vector, mode);
 
-	msgread_len = kfifo_out(fifo_addr, (char*)&hd, RINGBUF_MSG_SZ);
-	if(hd.src_qid != QEMU_PROCESS_ID) {
-		printk(KERN_ERR "invalid ring buffer msg\n");
-		goto err;
-	}
+	return 0;
+}
 
-	rmb();
+/*
+ * stop consuming a channel: the shared binding is cleared if it still
+ * names this peer, so that producers stop ringing us for it
+ */
+static void ringbuf_chan_unbind(unsigned int chan)
+{
+	rbsuper *super = ringbuf_dev.super;
 
-	memcpy(buffer, ringbuf_dev.payloads_st + hd.payload_off, 
-			MIN(len, hd.payload_len));
-	return 0;
+	ringbuf_dev.chan_mode[chan] = ChanNone;
+	cmpxchg(&super->chan[chan].consumer, ringbuf_dev.ivposition,
+			RINGBUF_PEER_NONE);
+	if (ringbuf_dev.peer_slot >= 0)
+		super->peers[ringbuf_dev.peer_slot].channels &= ~(1 << chan);
 
-err:
-	return -EFAULT;
+	printk(KERN_INFO "consumer of channel %u: none\n", chan);
 }
 
+static void ringbuf_super_exit(void)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int i;
+
+	if (!super)
+		return;
 
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++)
+		if (ringbuf_dev.chan_mode[i] != ChanNone)
+			cmpxchg(&super->chan[i].consumer, ringbuf_dev.ivposition,
+					RINGBUF_PEER_NONE);
+}
 
-static ssize_t ringbuf_write(struct file * filp, const char * buffer, 
-					size_t len, loff_t *offset)
+static inline rbring *ringbuf_ring(unsigned int chan)
 {
+	return (rbring *)(ringbuf_dev.rings + chan * RINGBUF_RING_SZ);
+}
+
+/*
+ * ask the consumer of a full ring to ring us back once it made room,
+ * unless we are between two slots after being declared dead
+ */
+static inline void ringbuf_want_room(rbring *ring)
+{
+	int slot = READ_ONCE(ringbuf_dev.peer_slot);
+
+	if (slot >= 0)
+		set_bit(slot, &ring->waiters);
+}
+
+/* messages are waiting in the ring of a channel or in its delivery queue */
+static inline bool ringbuf_readable(unsigned int chan)
+{
+	rbring *ring = ringbuf_ring(chan);
+
+	return READ_ONCE(ring->head) != READ_ONCE(ring->tail) ||
+		!list_empty(&ringbuf_dev.deliv[chan]);
+}
+
+/*
+ * pick up the rings as they are left in IVshmem space. A ring is only
+ * formatted if it was not formatted under the current superblock
+ * generation or if its indices make no sense, in-flight messages of a
+ * sane ring are kept.
+ */
+static void ringbuf_ring_init(void)
+{
+	rbsuper *super = ringbuf_dev.super;
+	unsigned int generation = READ_ONCE(super->generation);
+	rbring *ring;
+	unsigned int i;
+
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++) {
+		ring = ringbuf_ring(i);
+		if (READ_ONCE(ring->generation) == generation &&
+		    READ_ONCE(ring->size) == RINGBUF_SLOTS &&
+		    READ_ONCE(ring->head) - READ_ONCE(ring->tail)
+		    				<= RINGBUF_SLOTS)
+			continue;
+
+		printk(KERN_INFO "Start to init the ring of channel %u\n", i);
+		ring->size = RINGBUF_SLOTS;
+		ring->policy = PolicyDrop;
+		ring->head = 0;
+		ring->tail = 0;
+		memset(ring->ack, 0, sizeof(ring->ack));
+		ring->waiters = 0;
+		ring->epoch++;
+		wmb();
+		WRITE_ONCE(ring->generation, generation);
+	}
+
+	ringbuf_dev.generation = generation;
+}
+
+/*
+ * (re)attach to the shared state, on probe and whenever the layout has
+ * been formatted again behind our back
+ */
+static int ringbuf_attach(void)
+{
+	ringbuf_super_init();
+	ringbuf_ring_init();
+
+	return ringbuf_peer_attach();
+}
+
+static void free_msix_vectors(struct ringbuf_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nvectors; i++)
+		free_irq(pci_irq_vector(dev->dev, i), dev);
+	dev->nvectors = 0;
+
+	pci_free_irq_vectors(dev->dev);
+	kfree(dev->msix_names);
+}
+
+/*
+ * drain the channels we consume, as told by their mode
+ */
+static void ringbuf_readmsg(struct tasklet_struct* data)
+{
+	unsigned int chan;
+	u64 drained = this_cpu_read(ringbuf_pcpu_stats.msgs_recv);
+	u64 chan_drained;
+	rbring *ring;
+
+	RINGBUF_STAT_INC(tasklet_runs);
+	for (chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		if (ringbuf_dev.chan_mode[chan] == ChanNone)
+			continue;
+
+		chan_drained = this_cpu_read(ringbuf_pcpu_stats.msgs_recv);
+		switch (ringbuf_dev.chan_mode[chan]) {
+		case ChanMsg:
+			/* io_uring receives come first, read() gets the rest */
+			ringbuf_uring_drain(chan);
+
+			spin_lock(&ringbuf_dev.recv_lock);
+			ringbuf_deliver(chan);
+			spin_unlock(&ringbuf_dev.recv_lock);
+
+			ringbuf_event_arrival(chan);
+			wake_up_interruptible(&wait_queue);
+			break;
+
+		case ChanRpcServer:
+			ringbuf_event_arrival(chan);
+			wake_up_interruptible(&wait_queue);
+			break;
+
+		case ChanRpcClient:
+			ringbuf_rpc_complete(chan);
+			break;
+
+		case ChanKernel:
+			ringbuf_kchan_drain(chan);
+			break;
+		}
+
+		ring = ringbuf_ring(chan);
+		trace_ringbuf_drain(chan, ringbuf_dev.chan_mode[chan],
+			this_cpu_read(ringbuf_pcpu_stats.msgs_recv) - chan_drained,
+			READ_ONCE(ring->head) - READ_ONCE(ring->tail));
+	}
+
+	drained = this_cpu_read(ringbuf_pcpu_stats.msgs_recv) - drained;
+	RINGBUF_STAT_ADD(drain_msgs, drained);
+	if (drained > this_cpu_read(ringbuf_pcpu_stats.drain_max))
+		this_cpu_write(ringbuf_pcpu_stats.drain_max, drained);
+}
+
+/*
+ * prefetch ahead of the consumer of a channel at tail, so that the
+ * misses of a burst overlap: the slots of the next PREFETCH messages,
+ * and the payloads of the next PREFETCH / 2, whose slots were
+ * prefetched that many messages ago and are in cache by now
+ */
+static void ringbuf_prefetch(unsigned int chan, rbring *ring)
+{
+	unsigned int tail = ring->tail + 1, head = READ_ONCE(ring->head);
+	unsigned int *pf = &ringbuf_dev.pf_slot[chan];
+	unsigned int end, i, off, len;
+	const char *p;
+	rbslot *slot;
+
+	if(PREFETCH <= 0)
+		return;
+
+	if((int)(*pf - tail) < 0)
+		*pf = tail;
+	end = (int)(head - (tail + PREFETCH)) < 0 ? head : tail + PREFETCH;
+	for(; (int)(*pf - end) < 0; (*pf)++)
+		prefetch(&ring->slots[*pf & (RINGBUF_SLOTS - 1)]);
+
+	pf = &ringbuf_dev.pf_payload[chan];
+	if((int)(*pf - tail) < 0)
+		*pf = tail;
+	end = (int)(head - (tail + PREFETCH / 2)) < 0 ?
+		head : tail + PREFETCH / 2;
+	for(; (int)(*pf - end) < 0; (*pf)++) {
+		slot = &ring->slots[*pf & (RINGBUF_SLOTS - 1)];
+		if(READ_ONCE(slot->flags) & RBMSG_INLINE)
+			continue;
+		off = READ_ONCE(slot->ref.off);
+		if(off >= ringbuf_dev.arena_sz * RINGBUF_MAX_PEERS)
+			continue;
+		p = ringbuf_dev.payloads_st + off;
+		len = MIN(READ_ONCE(slot->len), RINGBUF_PREFETCH_MAX);
+		for(i = 0; i < len; i += L1_CACHE_BYTES)
+			prefetch(p + i);
+	}
+}
+
+/*
+ * look at the next message of a channel without consuming it, returns
+ * the peer slot of its producer or -ENODATA if the ring is empty.
+ * Invalid messages are consumed and skipped on the way. A lane gap is
+ * counted when sequence numbers were skipped (messages dropped by the
+ * producer or lost in a ring reset), and messages that were already
+ * consumed once are skipped as duplicates.
+ */
+static int ringbuf_peek(unsigned int chan, rbmsg_hd *hd)
+{
+	rbring *ring = ringbuf_ring(chan);
+	rbchan_stats *stats = &ringbuf_dev.stats[chan];
+	unsigned int *expect;
+	int slot;
+
+again:
+	if(rbring_peek(ring, hd))
+		return -ENODATA;
+	ringbuf_prefetch(chan, ring);
+
+	slot = ringbuf_peer_lookup(hd->src_qid);
+	if(slot < 0 || !ringbuf_peer_valid(hd->src_qid, hd->src_gen)) {
+		printk(KERN_ERR "msg from a stale incarnation of peer %u\n",
+			hd->src_qid);
+		goto skip;
+	}
+	if(hd->payload_len < 0 || ((hd->flags & RBMSG_INLINE) ?
+	   hd->payload_len > RBSLOT_INLINE : hd->payload_off + hd->payload_len
+				> ringbuf_dev.arena_sz * RINGBUF_MAX_PEERS)) {
+		printk(KERN_ERR "invalid ring buffer msg\n");
+		goto skip;
+	}
+
+	/* sequence numbers restart with every incarnation of a producer */
+	if(ringbuf_dev.expect_gen[slot] != hd->src_gen) {
+		memset(ringbuf_dev.expect[slot], 0,
+				sizeof(ringbuf_dev.expect[slot]));
+		ringbuf_dev.expect_gen[slot] = hd->src_gen;
+	}
+
+	expect = &ringbuf_dev.expect[slot][chan];
+	if(*expect && (int)(hd->seq - *expect) < 0) {
+		stats->dups++;
+		goto skip;
+	}
+	if(*expect && hd->seq != *expect) {
+		printk(KERN_WARNING "lane %u/%u: %u msgs missing before seq %u\n",
+			hd->src_qid, chan, hd->seq - *expect, hd->seq);
+		stats->gaps += hd->seq - *expect;
+		*expect = hd->seq;
+	}
+
+	return slot;
+
+skip:
+	rbring_skip(ring);
+	goto again;
+}
+
+/*
+ * consume the message returned by ringbuf_peek, once its payload has
+ * been copied out: ack it to its producer and hand back the slot
+ */
+static void ringbuf_consume(unsigned int chan, int slot, rbmsg_hd *hd)
+{
+	rbring *ring = ringbuf_ring(chan);
+
+	ringbuf_dev.expect[slot][chan] = hd->seq + 1;
+
+	rbring_consume(ring, slot, hd->seq);
+	ringbuf_kick_waiters(ring);
+
+	trace_ringbuf_dequeue(chan, hd->src_qid, hd->seq, hd->payload_off,
+		hd->payload_len, rbring_used(ring));
+
+	RINGBUF_STAT_INC(msgs_recv);
+	RINGBUF_STAT_ADD(bytes_recv, hd->payload_len);
+	ringbuf_lat_record(chan, LatDequeue, hd->tstamp);
+}
+
+/* where the payload of the message peeked from a channel is */
+static inline const char *ringbuf_payload_src(unsigned int chan,
+					const rbmsg_hd *hd)
+{
+	if(hd->flags & RBMSG_INLINE)
+		return (const char *)rbring_inline(ringbuf_ring(chan));
+
+	return ringbuf_dev.payloads_st + hd->payload_off;
+}
+
+/*
+ * copy the payload of a message from src into buffer, decompressing it
+ * unless raw, with recv_lock held. Returns the length copied, or
+ * -EBADMSG if it does not decompress.
+ */
+static ssize_t ringbuf_decode(const char *src, const rbmsg_hd *hd,
+				char *buffer, size_t len, bool raw)
+{
+	char *dst = buffer;
+	ssize_t ret = -EBADMSG;
+#ifdef RINGBUF_ZSTD
+	size_t n;
+#endif
+
+	if(raw || !(hd->flags & RBMSG_COMP_MASK)) {
+		ret = MIN(len, hd->payload_len);
+		rbcopy_from(&ringbuf_dev.copy, buffer, src, ret);
+		return ret;
+	}
+
+	if(!ringbuf_dev.decomp_buf ||
+	   hd->raw_len > ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS)
+		goto error;
+	/* a short buffer gets the head of the message, as if it was raw */
+	if(len < hd->raw_len)
+		dst = ringbuf_dev.decomp_buf;
+
+	switch(hd->flags & RBMSG_COMP_MASK) {
+#ifdef RINGBUF_LZ4
+	case RBMSG_LZ4:
+		ret = LZ4_decompress_safe(src, dst, hd->payload_len,
+					hd->raw_len);
+		break;
+#endif
+#ifdef RINGBUF_ZSTD
+	case RBMSG_ZSTD:
+		n = zstd_decompress_dctx(ringbuf_dev.zstd_dctx, dst,
+				hd->raw_len, src, hd->payload_len);
+		if(!zstd_is_error(n))
+			ret = n;
+		break;
+#endif
+	}
+	if(ret != hd->raw_len)
+		goto error;
+
+	if(dst != buffer) {
+		ret = MIN(len, ret);
+		memcpy(buffer, dst, ret);
+	}
+	return ret;
+
+error:
+	RINGBUF_STAT_INC(decomp_errors);
+	printk(KERN_ERR "ringbuf: msg %u from peer %u does not decompress\n",
+		hd->seq, hd->src_qid);
+	return -EBADMSG;
+}
+
+/* the payload of the message peeked from a channel, into buffer */
+static inline ssize_t ringbuf_payload(unsigned int chan, const rbmsg_hd *hd,
+				char *buffer, size_t len, bool raw)
+{
+	return ringbuf_decode(ringbuf_payload_src(chan, hd), hd,
+				buffer, len, raw);
+}
+
+/*
+ * look at the next message of a channel, from its delivery queue before
+ * the ring, with recv_lock held. Returns where its payload is, or NULL
+ * if there is none, and sets slot for ringbuf_done().
+ */
+static const char *ringbuf_next(unsigned int chan, rbmsg_hd *hd, int *slot)
+{
+	rbdeliv_msg *msg;
+
+	msg = list_first_entry_or_null(&ringbuf_dev.deliv[chan],
+					rbdeliv_msg, list);
+	if(msg) {
+		*hd = msg->hd;
+		*slot = RINGBUF_SLOT_QUEUED;
+		return msg->data;
+	}
+
+	*slot = ringbuf_peek(chan, hd);
+	if(*slot < 0)
+		return NULL;
+
+	return ringbuf_payload_src(chan, hd);
+}
+
+/* consume the message returned by ringbuf_next */
+static void ringbuf_done(unsigned int chan, int slot, rbmsg_hd *hd)
+{
+	rbdeliv_msg *msg;
+
+	if(slot != RINGBUF_SLOT_QUEUED) {
+		ringbuf_consume(chan, slot, hd);
+		return;
+	}
+
+	msg = list_first_entry(&ringbuf_dev.deliv[chan], rbdeliv_msg, list);
+	list_del(&msg->list);
+	ringbuf_dev.deliv_bytes[chan] -= msg->hd.payload_len;
+	kfree(msg);
+}
+
+/*
+ * move the messages of a ChanMsg channel out of the ring into its
+ * delivery queue, from the tasklet with recv_lock held, so that their
+ * slots and payloads go back to the producers without waiting for the
+ * reader. Stops at DELIVER_KB, or when memory is short, leaving the
+ * rest in the ring.
+ */
+static void ringbuf_deliver(unsigned int chan)
+{
+	size_t limit = (size_t)MAX(DELIVER_KB, 0) * 1024;
+	rbdeliv_msg *msg;
+	rbmsg_hd hd;
+	int slot;
+
+	while(ringbuf_dev.deliv_bytes[chan] < limit &&
+	      (slot = ringbuf_peek(chan, &hd)) >= 0) {
+		msg = kmalloc(struct_size(msg, data, hd.payload_len),
+				GFP_ATOMIC | __GFP_NOWARN);
+		if(!msg)
+			break;
+
+		msg->hd = hd;
+		rbcopy_from(&ringbuf_dev.copy, msg->data,
+			ringbuf_payload_src(chan, &hd), hd.payload_len);
+		ringbuf_consume(chan, slot, &hd);
+
+		list_add_tail(&msg->list, &ringbuf_dev.deliv[chan]);
+		ringbuf_dev.deliv_bytes[chan] += hd.payload_len;
+
+		if(LOG_MSGS)
+			printk(KERN_INFO "recv msg: %.*s\n",
+				(hd.flags & RBMSG_COMP_MASK) ? 0 :
+				(int)MIN(hd.payload_len, 512), msg->data);
+	}
+}
+
+/* drop what is left in the delivery queues */
+static void ringbuf_deliver_exit(void)
+{
+	rbdeliv_msg *msg, *tmp;
+	unsigned int chan;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		list_for_each_entry_safe(msg, tmp, &ringbuf_dev.deliv[chan],
+					list) {
+			list_del(&msg->list);
+			kfree(msg);
+		}
+		ringbuf_dev.deliv_bytes[chan] = 0;
+	}
+}
+
+/*
+ * consume one message of a channel into buffer, returns its length.
+ * A message that does not decompress is consumed all the same.
+ */
+static ssize_t ringbuf_recv(unsigned int chan, char *buffer, size_t len,
+				rbmsg_hd *hd, bool raw)
+{
+	const char *src;
+	rbmsg_hd msg;
+	int slot;
+	ssize_t ret;
+
+	if(!hd)
+		hd = &msg;
+
+	src = ringbuf_next(chan, hd, &slot);
+	if(!src)
+		return slot;
+
+	ret = ringbuf_decode(src, hd, buffer, len, raw);
+	ringbuf_done(chan, slot, hd);
+
+	return ret;
+}
+
+/* account a message that went through an open file */
+static inline void ringbuf_file_count(rbfile *f, bool sent, size_t len)
+{
+	if(sent) {
+		atomic64_inc(&f->msgs_sent);
+		atomic64_add(len, &f->bytes_sent);
+	} else {
+		atomic64_inc(&f->msgs_recv);
+		atomic64_add(len, &f->bytes_recv);
+	}
+}
+
+/*
+ * one message of the rx channel of the file. An empty channel reads 0,
+ * or sleeps with RBFILE_WAIT, or fails with -EAGAIN if O_NONBLOCK too.
+ */
+static ssize_t ringbuf_read(struct file * filp, char * buffer, size_t len, 
+							loff_t *offset)
+{
+	rbfile *f = filp->private_data;
+	unsigned int chan = READ_ONCE(f->opts.rx_chan);
+	unsigned int flags = READ_ONCE(f->opts.flags);
+	ssize_t ret;
+	rbmsg_hd hd;
+	char *buf;
+
+	/* only what this peer consumes as messages can be read */
+	if(ringbuf_dev.chan_mode[chan] != ChanMsg) {
+		printk(KERN_ERR "ringbuf: not allowed to read \n");
+		return 0;
+	}
+	if(!ringbuf_dev.base_addr || !ringbuf_dev.rings) {
+		printk(KERN_ERR "ringbuf: cannot read from addr (NULL)\n");
+		return 0;
+	}
+
+	/* the copy engines work on kernel memory, not on user pointers */
+	len = MIN(len, ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS);
+	buf = kmalloc(len, GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+
+	for(;;) {
+		spin_lock_bh(&ringbuf_dev.recv_lock);
+		ret = ringbuf_recv(chan, buf, len, &hd, flags & RBFILE_RAW);
+		spin_unlock_bh(&ringbuf_dev.recv_lock);
+		if(ret != -ENODATA || !(flags & RBFILE_WAIT))
+			break;
+
+		ret = -EAGAIN;
+		if(filp->f_flags & O_NONBLOCK)
+			break;
+		ret = wait_event_interruptible(wait_queue,
+				ringbuf_readable(chan));
+		if(ret)
+			break;
+	}
+	if(ret == -ENODATA) {
+		printk(KERN_ERR "no msg in ring buffer\n");
+		ret = 0;
+	}
+	if(ret > 0) {
+		if(copy_to_user(buffer, buf, ret)) {
+			ret = -EFAULT;
+		} else {
+			ringbuf_file_count(f, false, ret);
+			ringbuf_lat_record(chan, LatDeliver, hd.tstamp);
+		}
+	}
+	kfree(buf);
+
+	return ret;
+}
+
+/*
+ * forget the messages of a lane window that the consumer has acked
+ */
+static void ringbuf_window_release(unsigned int chan)
+{
+	rbwindow_release(&ringbuf_dev.window[chan],
+		READ_ONCE(ringbuf_ring(chan)->ack[ringbuf_dev.peer_slot]));
+}
+
+/*
+ * find room for len bytes in the lane slice of a channel, behind the
+ * messages still in the window. Returns the offset in the lane slice,
+ * or -ENOBUFS if the window or the slice is full.
+ */
+static long ringbuf_window_alloc(unsigned int chan, size_t len)
+{
+	rbpeer *self = &ringbuf_dev.super->peers[ringbuf_dev.peer_slot];
+	rbring *ring = ringbuf_ring(chan);
+
+	if(test_bit(chan, &ringbuf_dev.fenced)) {
+		if(READ_ONCE(ring->epoch) == ringbuf_dev.fence_epoch[chan] &&
+		   (int)(READ_ONCE(ring->ack[ringbuf_dev.peer_slot]) -
+			 ringbuf_dev.fence[chan]) < 0)
+			return -ENOBUFS;
+		clear_bit(chan, &ringbuf_dev.fenced);
+	}
+
+	ringbuf_window_release(chan);
+
+	return rbwindow_alloc(&ringbuf_dev.window[chan], self->arena_pt[chan],
+			ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS, len);
+}
+
+/*
+ * ticket @ticket got write_lock: skip it if its holder is dead, or ring
+ * its holder if it parked
+ */
+static void ringbuf_lock_pass(unsigned int ticket)
+{
+	rblock *lock = ringbuf_dev.write_lock;
+	unsigned int ivposition;
+	int slot;
+
+	for(;;) {
+		slot = rblock_waiter(lock, ticket);
+		if(slot < 0)
+			return;
+
+		if(READ_ONCE(ringbuf_dev.super->peers[slot].state) == PeerDead) {
+			if(!rblock_skip(lock, slot, ticket))
+				return;
+			RINGBUF_STAT_INC(lock_skipped);
+			ticket += RBLOCK_STEP;
+			continue;
+		}
+
+		if(rblock_unpark(lock, slot)) {
+			ivposition = READ_ONCE(ringbuf_dev.super->peers[slot].ivposition);
+			ringbuf_doorbell(ivposition, 0);
+		}
+		return;
+	}
+}
+
+/*
+ * wait for our ticket. Publishers hold lane_lock with BHs off and cannot
+ * sleep, so after RINGBUF_LOCK_SPIN turns on the lock a waiter parks:
+ * it asks to be rung and watches lock_kick, set by our interrupt
+ * handler, only looking at IVshmem space every RINGBUF_LOCK_RECHECK_NSEC
+ * in case the doorbell is lost. A ticket nobody holds for
+ * RINGBUF_LOCK_BREAK_MSEC is skipped, its taker died before it could
+ * record it. Returns false if our own ticket was skipped while we were
+ * stalled, a new one has to be taken.
+ */
+static bool ringbuf_lock_wait(rblock *lock, unsigned int ticket)
+{
+	u64 start = ktime_get_ns(), now, recheck = 0, stuck = start;
+	unsigned int serving, seen = READ_ONCE(lock->serving);
+	unsigned int i;
+	bool ret = true;
+
+	RINGBUF_STAT_INC(lock_contended);
+
+	for(i = 0; i < RINGBUF_LOCK_SPIN; i++) {
+		if(rblock_granted(lock, ticket))
+			goto out;
+		cpu_relax();
+	}
+
+	RINGBUF_STAT_INC(lock_parked);
+	for(;;) {
+		if(READ_ONCE(lock->ticket[ringbuf_dev.peer_slot]) != ticket ||
+		   (int)(READ_ONCE(lock->serving) - ticket) > 0) {
+			ret = false;
+			break;
+		}
+
+		WRITE_ONCE(ringbuf_dev.lock_kick, 0);
+		if(rblock_park(lock, ringbuf_dev.peer_slot, ticket))
+			break;
+
+		now = ktime_get_ns();
+		recheck = now + RINGBUF_LOCK_RECHECK_NSEC;
+		while(!READ_ONCE(ringbuf_dev.lock_kick) && now < recheck) {
+			cpu_relax();
+			now = ktime_get_ns();
+		}
+		if(rblock_granted(lock, ticket))
+			break;
+
+		serving = READ_ONCE(lock->serving);
+		if(serving != seen) {
+			seen = serving;
+			stuck = now;
+		} else if(now - stuck > (u64)RINGBUF_LOCK_BREAK_MSEC * NSEC_PER_MSEC &&
+			  rblock_waiter(lock, serving) < 0 &&
+			  rblock_skip(lock, -1, serving)) {
+			printk(KERN_WARNING "ringbuf: skipping orphaned write lock ticket %u\n",
+				serving);
+			RINGBUF_STAT_INC(lock_skipped);
+			ringbuf_lock_pass(serving + RBLOCK_STEP);
+		}
+	}
+
+out:
+	now = ktime_get_ns() - start;
+	RINGBUF_STAT_ADD(lock_wait_ns, now);
+	if(now > this_cpu_read(ringbuf_pcpu_stats.lock_wait_max))
+		this_cpu_write(ringbuf_pcpu_stats.lock_wait_max, now);
+
+	return ret;
+}
+
+static void ringbuf_lock(void)
+{
+	rblock *lock = ringbuf_dev.write_lock;
+	unsigned int ticket;
+
+	do {
+		ticket = rblock_ticket(lock, ringbuf_dev.peer_slot);
+	} while(!rblock_granted(lock, ticket) && !ringbuf_lock_wait(lock, ticket));
+	smp_mb();
+
+	ringbuf_dev.lock_ticket = ticket;
+	WRITE_ONCE(ringbuf_dev.super->lock_owner, ringbuf_dev.ivposition);
+}
+
+/*
+ * write_lock is still ours: a peer that took us for dead while we were
+ * stalled may have skipped our ticket
+ */
+static inline bool ringbuf_lock_held(void)
+{
+	return rblock_granted(ringbuf_dev.write_lock, ringbuf_dev.lock_ticket);
+}
+
+static void ringbuf_unlock(void)
+{
+	if(!ringbuf_lock_held()) {
+		printk(KERN_WARNING "ringbuf: write lock was broken while we held it\n");
+		cmpxchg(&ringbuf_dev.super->lock_owner, ringbuf_dev.ivposition,
+				RINGBUF_PEER_NONE);
+		return;
+	}
+
+	WRITE_ONCE(ringbuf_dev.super->lock_owner, RINGBUF_PEER_NONE);
+	ringbuf_lock_pass(rblock_release(ringbuf_dev.write_lock,
+					ringbuf_dev.peer_slot));
+}
+
+/*
+ * hold write_lock across the publishes that follow, with lane_lock held,
+ * so that a batch takes it once
+ */
+static void ringbuf_lock_batch(void)
+{
+	ringbuf_lock();
+	ringbuf_dev.lock_batch = true;
+}
+
+static void ringbuf_unlock_batch(void)
+{
+	ringbuf_dev.lock_batch = false;
+	ringbuf_unlock();
+}
+
+/*
+ * put a header in the ring, with data if it goes inline, under
+ * write_lock. Returns -ENOBUFS if the ring is full, -ENOTCONN if the
+ * lock was broken under us, the ring is then not ours to touch.
+ */
+static int ringbuf_publish(unsigned int chan, rbring *ring, rbmsg_hd *hd,
+				const void *data)
+{
+	int ret;
+
+	if(!ringbuf_dev.lock_batch)
+		ringbuf_lock();
+
+	if(ringbuf_lock_held())
+		ret = rbring_publish(ring, hd, data);
+	else
+		ret = -ENOTCONN;
+	if(!ret)
+		trace_ringbuf_enqueue(chan, hd->src_qid, hd->seq,
+			hd->payload_off, hd->payload_len, rbring_used(ring));
+
+	if(!ringbuf_dev.lock_batch)
+		ringbuf_unlock();
+
+	return ret;
+}
+
+/*
+ * room to take in the lane slice for a message of len bytes, with
+ * lane_lock held: none if it goes inline in its ring slot, the worst
+ * case of its compression if the channel compresses it. Messages whose
+ * worst case does not fit the slice, or gathered from n > 1 pieces, go
+ * raw.
+ */
+static size_t ringbuf_reserve(unsigned int chan, size_t len, unsigned int n)
+{
+	size_t bound = len;
+
+	if(len <= RBSLOT_INLINE)
+		return 0;
+	if(len < ringbuf_dev.comp_threshold[chan] || n > 1)
+		return len;
+
+	switch(ringbuf_dev.comp_algo[chan]) {
+#ifdef RINGBUF_LZ4
+	case CompLz4:
+		bound = LZ4_compressBound(len);
+		break;
+#endif
+#ifdef RINGBUF_ZSTD
+	case CompZstd:
+		bound = zstd_compress_bound(len);
+		break;
+#endif
+	}
+
+	return bound <= ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS ?
+		bound : len;
+}
+
+/*
+ * compress a message straight into its room of the lane slice, with
+ * lane_lock held. Returns the RBMSG_ flag of the algorithm and sets
+ * clen, or 0 if the message would not get shorter.
+ */
+static unsigned int ringbuf_compress(unsigned int chan, char *dst,
+		size_t room, const char *src, size_t len, size_t *clen)
+{
+	unsigned int flag = 0;
+	size_t n = 0;
+
+	switch(ringbuf_dev.comp_algo[chan]) {
+#ifdef RINGBUF_LZ4
+	case CompLz4:
+		n = LZ4_compress_default(src, dst, len, room,
+					ringbuf_dev.lz4_wrkmem);
+		flag = RBMSG_LZ4;
+		break;
+#endif
+#ifdef RINGBUF_ZSTD
+	case CompZstd:
+		n = zstd_compress_cctx(ringbuf_dev.zstd_cctx, dst, room,
+				src, len, &ringbuf_dev.zstd_params);
+		if(zstd_is_error(n))
+			n = 0;
+		flag = RBMSG_ZSTD;
+		break;
+#endif
+	}
+	if(!n || n >= len)
+		return 0;
+
+	*clen = n;
+	return flag;
+}
+
+static inline size_t ringbuf_iov_len(const struct kvec *iov, unsigned int n)
+{
+	size_t len = 0;
+
+	while(n--)
+		len += iov[n].iov_len;
+
+	return len;
+}
+
+/*
+ * send one message to a channel, gathered from n pieces, the caller
+ * rings its consumer. Returns -ENOBUFS if there is no room in the ring,
+ * in the window or in the lane slice.
+ */
+static ssize_t ringbuf_sendv(unsigned int chan, const struct kvec *iov,
+		unsigned int n, unsigned int flags, unsigned int corr_id)
+{
+	rbmsg_hd hd;
+	rbring *ring = ringbuf_ring(chan);
+	rbwindow *win = &ringbuf_dev.window[chan];
+	rbpeer *self;
+	const char *buffer = n ? iov[0].iov_base : NULL;
+	size_t len = ringbuf_iov_len(iov, n);
+	char small[RBSLOT_INLINE];
+	char *payload;
+	size_t room, clen, done;
+	unsigned int comp = 0, i;
+	long pt;
+	int ret;
+
+	/* nothing goes out of a slot we were declared dead in */
+	if(ringbuf_dev.peer_slot < 0)
+		return -ENOTCONN;
+	self = &ringbuf_dev.super->peers[ringbuf_dev.peer_slot];
+	if(READ_ONCE(self->state) != PeerAlive)
+		return -ENOTCONN;
+
+	room = ringbuf_reserve(chan, len, n);
+	pt = ringbuf_window_alloc(chan, room);
+	if(pt < 0)
+		return pt;
+
+	hd.src_qid = ringbuf_dev.ivposition;
+	hd.src_gen = self->generation;
+	hd.seq = self->seq[chan] + 1;
+	hd.flags = flags;
+	hd.corr_id = corr_id;
+	hd.tstamp = ktime_get_real_ns();
+	hd.payload_off = ringbuf_dev.peer_slot * ringbuf_dev.arena_sz
+			+ chan * (ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS)
+			+ pt;
+	hd.payload_len = len;
+	hd.raw_len = len;
+	payload = ringbuf_dev.payloads_st + hd.payload_off;
+
+	if(!room)
+		hd.flags |= RBMSG_INLINE;
+	else if(room > len)
+		comp = ringbuf_compress(chan, payload, room, buffer, len, &clen);
+	if(comp) {
+		hd.flags |= comp;
+		hd.payload_len = clen;
+	} else if(room) {
+		for(i = 0, done = 0; i < n; done += iov[i++].iov_len)
+			rbcopy_to(&ringbuf_dev.copy, payload + done,
+					iov[i].iov_base, iov[i].iov_len);
+	} else if(n > 1) {
+		/* the slot takes an inline payload in one piece */
+		for(i = 0, done = 0; i < n; done += iov[i++].iov_len)
+			memcpy(small + done, iov[i].iov_base, iov[i].iov_len);
+		buffer = small;
+	}
+
+	wmb();
+
+	if(win->first == win->last)
+		win->epoch = READ_ONCE(ring->epoch);
+
+	ret = ringbuf_publish(chan, ring, &hd, buffer);
+	if(ret)
+		return ret;
+
+	rbwindow_push(win, &hd, pt, buffer);
+
+	self->seq[chan] = hd.seq;
+	if(room)
+		self->arena_pt[chan] = pt + hd.payload_len;
+
+	RINGBUF_STAT_INC(msgs_sent);
+	RINGBUF_STAT_ADD(bytes_sent, len);
+	if(comp) {
+		RINGBUF_STAT_INC(comp_msgs);
+		RINGBUF_STAT_ADD(comp_saved, len - hd.payload_len);
+	}
+
+	return len;
+}
+
+static inline ssize_t ringbuf_send(unsigned int chan, const char *buffer,
+		size_t len, unsigned int flags, unsigned int corr_id)
+{
+	struct kvec iov = { .iov_base = (void *)buffer, .iov_len = len };
+
+	return ringbuf_sendv(chan, &iov, 1, flags, corr_id);
+}
+
+/*
+ * if the ring of a channel was formatted since we sent the messages in
+ * our window, send again those the consumer had not acked
+ */
+static void ringbuf_retransmit(unsigned int chan)
+{
+	rbmsg_hd hd;
+	rbring *ring = ringbuf_ring(chan);
+	rbwindow *win = &ringbuf_dev.window[chan];
+	rbpeer *self;
+	unsigned int i, idx, epoch;
+
+	if(ringbuf_dev.peer_slot < 0 || win->first == win->last)
+		return;
+
+	epoch = READ_ONCE(ring->epoch);
+	if(win->epoch == epoch)
+		return;
+
+	self = &ringbuf_dev.super->peers[ringbuf_dev.peer_slot];
+	ringbuf_window_release(chan);
+
+	for(i = win->first; i != win->last; i++) {
+		idx = i % RINGBUF_WINDOW;
+		hd.src_qid = ringbuf_dev.ivposition;
+		hd.src_gen = self->generation;
+		hd.seq = win->seq[idx];
+		hd.flags = win->flags[idx];
+		hd.corr_id = win->corr_id[idx];
+		hd.tstamp = win->tstamp[idx];
+		hd.payload_off = ringbuf_dev.peer_slot * ringbuf_dev.arena_sz
+			+ chan * (ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS)
+			+ win->off[idx];
+		hd.payload_len = win->len[idx];
+		hd.raw_len = win->raw_len[idx];
+
+		/* try again on the next poll for what does not fit */
+		if(ringbuf_publish(chan, ring, &hd, win->data[idx]))
+			break;
+		ringbuf_dev.stats[chan].retransmits++;
+	}
+
+	if(i == win->last)
+		win->epoch = epoch;
+	if(i != win->first)
+		ringbuf_kick(chan);
+}
+
+static bool ringbuf_writable(unsigned int chan, size_t len, unsigned int n)
+{
+	rbring *ring = ringbuf_ring(chan);
+	bool ret;
+
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	ret = ringbuf_dev.peer_slot >= 0 &&
+		READ_ONCE(ring->head) - READ_ONCE(ring->tail) < RINGBUF_SLOTS &&
+		ringbuf_window_alloc(chan, ringbuf_reserve(chan, len, n)) >= 0;
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	return ret;
+}
+
+/*
+ * drop a message a full ring that does not block has no room for:
+ * burn its sequence number, the consumer sees the gap
+ */
+static ssize_t ringbuf_send_drop(unsigned int chan)
+{
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	if(ringbuf_dev.peer_slot >= 0)
+		ringbuf_dev.super->peers[ringbuf_dev.peer_slot].seq[chan]++;
+	ringbuf_dev.stats[chan].drops++;
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+	printk(KERN_ERR "not enough space in ring buffer\n");
+
+	return -ENOBUFS;
+}
+
+/*
+ * send one message gathered from n pieces, sleeping for room if the
+ * channel policy says so
+ */
+static ssize_t ringbuf_sendv_wait(unsigned int chan, const struct kvec *iov,
+		unsigned int n, unsigned int flags, unsigned int corr_id)
+{
+	rbring *ring = ringbuf_ring(chan);
+	size_t len = ringbuf_iov_len(iov, n);
+	ssize_t ret;
+
+	if(ringbuf_dev.peer_slot < 0) {
+		printk(KERN_ERR "ringbuf: not attached to the peer table\n");
+		return -ENOTCONN;
+	}
+	if(len > ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS) {
+		printk(KERN_ERR "msg larger than the lane slice\n");
+		return -EMSGSIZE;
+	}
+
+	for(;;) {
+		spin_lock_bh(&ringbuf_dev.lane_lock);
+		ret = ringbuf_sendv(chan, iov, n, flags, corr_id);
+		spin_unlock_bh(&ringbuf_dev.lane_lock);
+		if(ret != -ENOBUFS) {
+			if(ret >= 0)
+				ringbuf_kick(chan);
+			ringbuf_event_space(chan);
+			break;
+		}
+		RINGBUF_STAT_INC(ring_full);
+
+		if(READ_ONCE(ring->policy) != PolicyBlock)
+			return ringbuf_send_drop(chan);
+
+		/*
+		 * ask the consumer to ring us back once it made room, and
+		 * poll anyway in case the doorbell is missed
+		 */
+		ringbuf_want_room(ring);
+		ret = wait_event_interruptible_timeout(wait_queue,
+				ringbuf_writable(chan, len, n),
+				msecs_to_jiffies(SLEEP_PERIOD_MSEC));
+		if(ret < 0)
+			return ret;
+	}
+
+	return ret;
+}
+
+static inline ssize_t ringbuf_send_wait(unsigned int chan, const char *buffer,
+		size_t len, unsigned int flags, unsigned int corr_id)
+{
+	struct kvec iov = { .iov_base = (void *)buffer, .iov_len = len };
+
+	return ringbuf_sendv_wait(chan, &iov, 1, flags, corr_id);
+}
+
+/*
+ * send without waiting for room, -ENOBUFS on a full ring
+ */
+static ssize_t ringbuf_sendv_try(unsigned int chan, const struct kvec *iov,
+				unsigned int n)
+{
+	ssize_t ret;
+
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	ret = ringbuf_sendv(chan, iov, n, 0, 0);
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	if(ret >= 0)
+		ringbuf_kick(chan);
+	ringbuf_event_space(chan);
+	if(ret == -ENOBUFS)
+		RINGBUF_STAT_INC(ring_full);
+
+	return ret;
+}
+
+/*
+ * publish the backlog, then what every CPU has staged, with lane_lock
+ * held: one hold of write_lock for the whole batch, then one doorbell
+ * per channel. Once a ring is full, the writes that follow to it go to
+ * the backlog behind the first one if their writers wait for room, and
+ * fail otherwise, so that none overtakes another.
+ */
+static void ringbuf_combine(void)
+{
+	rbstage_req *req, *tmp;
+	unsigned long chans = 0, full = 0;
+	unsigned int chan, n = 0;
+	LIST_HEAD(reqs);
+	rbstage *stage;
+	int cpu;
+
+	list_splice_init(&ringbuf_dev.stage_backlog, &reqs);
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(&ringbuf_stage, cpu);
+		spin_lock(&stage->lock);
+		list_splice_tail_init(&stage->reqs, &reqs);
+		spin_unlock(&stage->lock);
+	}
+	if(list_empty(&reqs))
+		return;
+
+	ringbuf_lock_batch();
+	list_for_each_entry(req, &reqs, list) {
+		if(test_bit(req->chan, &full))
+			req->ret = -ENOBUFS;
+		else
+			req->ret = ringbuf_sendv(req->chan, &req->iov, 1, 0, 0);
+		if(req->ret == -ENOBUFS)
+			__set_bit(req->chan, &full);
+		else if(req->ret >= 0)
+			__set_bit(req->chan, &chans);
+		n++;
+	}
+	ringbuf_unlock_batch();
+
+	RINGBUF_STAT_INC(combine_runs);
+	RINGBUF_STAT_ADD(combine_msgs, n);
+
+	/* the writers go as soon as done is set, their reqs with them */
+	list_for_each_entry_safe(req, tmp, &reqs, list) {
+		list_del(&req->list);
+		if(req->ret == -ENOBUFS && req->wait &&
+		   READ_ONCE(ringbuf_ring(req->chan)->policy) == PolicyBlock) {
+			list_add_tail(&req->list, &ringbuf_dev.stage_backlog);
+			WRITE_ONCE(req->queued, 1);
+			continue;
+		}
+		smp_store_release(&req->done, 1);
+	}
+
+	for_each_set_bit(chan, &chans, RINGBUF_MAX_CHANNELS)
+		ringbuf_kick(chan);
+	for_each_set_bit(chan, &full, RINGBUF_MAX_CHANNELS) {
+		RINGBUF_STAT_INC(ring_full);
+		ringbuf_want_room(ringbuf_ring(chan));
+	}
+}
+
+/*
+ * send one message through the staging area of this CPU. The first
+ * writer to get lane_lock combines the writes of all CPUs, the others
+ * spin until theirs is done, or until they can combine themselves, and
+ * after RINGBUF_LOCK_SPIN turns queue on lane_lock like any writer.
+ * A write on the backlog sleeps until the consumer rings us, then
+ * combines again. -ENOBUFS on a full ring that does not block, or
+ * without wait, as ringbuf_sendv_try().
+ */
+static ssize_t ringbuf_send_staged(unsigned int chan, const char *buf,
+				size_t len, bool wait)
+{
+	rbstage_req req = {
+		.chan = chan,
+		.iov = { .iov_base = (void *)buf, .iov_len = len },
+		.wait = wait,
+	};
+	long ret;
+	unsigned int spins;
+	rbstage *stage;
+
+	stage = get_cpu_ptr(&ringbuf_stage);
+	spin_lock_bh(&stage->lock);
+	list_add_tail(&req.list, &stage->reqs);
+	spin_unlock_bh(&stage->lock);
+	put_cpu_ptr(&ringbuf_stage);
+
+	for(spins = 0; !smp_load_acquire(&req.done); spins++) {
+		if(READ_ONCE(req.queued)) {
+			ret = wait_event_interruptible_timeout(wait_queue,
+					smp_load_acquire(&req.done),
+					msecs_to_jiffies(SLEEP_PERIOD_MSEC));
+			spin_lock_bh(&ringbuf_dev.lane_lock);
+			if(ret < 0 && !req.done) {
+				/* leave the backlog, nothing was sent */
+				list_del(&req.list);
+				req.ret = ret;
+				req.done = 1;
+			}
+		} else if(spins >= RINGBUF_LOCK_SPIN) {
+			spin_lock_bh(&ringbuf_dev.lane_lock);
+		} else if(!spin_trylock_bh(&ringbuf_dev.lane_lock)) {
+			cpu_relax();
+			continue;
+		}
+		ringbuf_combine();
+		spin_unlock_bh(&ringbuf_dev.lane_lock);
+	}
+
+	ringbuf_event_space(chan);
+
+	return req.ret;
+}
+
+/*
+ * one message to the tx channel of the file. A full ring fails with
+ * -EAGAIN if O_NONBLOCK, and the consumer is asked to ring us back so
+ * that poll() reports the room.
+ */
+static ssize_t ringbuf_write(struct file * filp, const char * buffer, 
+					size_t len, loff_t *offset)
+{
+	rbfile *f = filp->private_data;
+	unsigned int chan = READ_ONCE(f->opts.tx_chan);
+	struct kvec iov;
+	ssize_t ret;
+	char *buf;
+
+	/* not to a channel we consume ourselves */
+	if(ringbuf_dev.chan_mode[chan] != ChanNone) {
+		printk(KERN_ERR "ringbuf: not allowed to write \n");
+		return 0;
+	}
+	if(!ringbuf_dev.base_addr || !ringbuf_dev.rings) {
+		printk(KERN_ERR "ringbuf: cannot read from addr (NULL)\n");
+		return 0;
+	}
+	if(len > ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS) {
+		printk(KERN_ERR "msg larger than the lane slice\n");
+		return -EMSGSIZE;
+	}
+
+	if(ringbuf_dev.peer_slot < 0)
+		return -ENOTCONN;
+
+	buf = memdup_user(buffer, len);
+	if(IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	if(COMBINE) {
+		/* the combiner keeps what waits for room in order */
+		ret = ringbuf_send_staged(chan, buf, len,
+				!(filp->f_flags & O_NONBLOCK));
+		if(ret == -ENOBUFS && !(filp->f_flags & O_NONBLOCK))
+			ret = ringbuf_send_drop(chan);
+	} else {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = ringbuf_sendv_try(chan, &iov, 1);
+		if(ret == -ENOBUFS && !(filp->f_flags & O_NONBLOCK))
+			ret = ringbuf_send_wait(chan, buf, len, 0, 0);
+	}
+	if(ret == -ENOBUFS && (filp->f_flags & O_NONBLOCK)) {
+		ringbuf_want_room(ringbuf_ring(chan));
+		ret = -EAGAIN;
+	}
+	kfree(buf);
+
+	if(ret >= 0)
+		ringbuf_file_count(f, true, len);
+	else if(ret == -EAGAIN || ret == -ENOBUFS)
+		atomic64_inc(&f->full);
+
+	return ret;
+}
+
+/*
+ * consume a channel as messages, binding it if nobody consumes it here,
+ * -EINVAL if it is consumed otherwise
+ */
+static int ringbuf_msg_bind(unsigned int chan)
+{
+	if(ringbuf_dev.chan_mode[chan] == ChanNone)
+		return ringbuf_chan_bind(chan, ChanMsg);
+	if(ringbuf_dev.chan_mode[chan] != ChanMsg)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * IOCTL_FILE/IOCTL_FILE_STATS: the settings and counters of one open
+ * file, which leave the other files of the device alone
+ */
+static long ringbuf_file_ioctl(rbfile *f, unsigned int cmd, unsigned long arg)
+{
+	rbfile_opts opts;
+	rbfile_stats stats;
+	long ret;
+
+	if(cmd == IOCTL_FILE_STATS) {
+		stats.msgs_sent = atomic64_read(&f->msgs_sent);
+		stats.bytes_sent = atomic64_read(&f->bytes_sent);
+		stats.msgs_recv = atomic64_read(&f->msgs_recv);
+		stats.bytes_recv = atomic64_read(&f->bytes_recv);
+		stats.full = atomic64_read(&f->full);
+		if(copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if(copy_from_user(&opts, (void __user *)arg, sizeof(opts)))
+		return -EFAULT;
+	if(opts.rx_chan >= RINGBUF_MAX_CHANNELS ||
+	   opts.tx_chan >= RINGBUF_MAX_CHANNELS ||
+	   opts.flags & ~(RBFILE_WAIT | RBFILE_RAW))
+		return -EINVAL;
+
+	if(opts.rx_chan != READ_ONCE(f->opts.rx_chan)) {
+		ret = ringbuf_msg_bind(opts.rx_chan);
+		if(ret)
+			return ret;
+	}
+
+	WRITE_ONCE(f->opts.rx_chan, opts.rx_chan);
+	WRITE_ONCE(f->opts.tx_chan, opts.tx_chan);
+	WRITE_ONCE(f->opts.flags, opts.flags);
+
+	return 0;
+}
+
+/*
+ * IOCTL_SEND/IOCTL_RECV: one message from or to a user buffer. Receiving
+ * from a channel nobody consumes here binds it, and is served from what
+ * the tasklet queued before the ring.
+ */
+static long ringbuf_msg_ioctl(rbfile *f, unsigned int cmd,
+				rbmsg_io __user *uarg)
+{
+	rbmsg_io arg;
+	rbmsg_hd hd;
+	char *buf;
+	long ret;
+
+	if(copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if(arg.chan >= RINGBUF_MAX_CHANNELS || !arg.len)
+		return -EINVAL;
+	arg.len = MIN(arg.len, ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS);
+
+	buf = kmalloc(arg.len, GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+
+	if(cmd == IOCTL_SEND) {
+		if(copy_from_user(buf, u64_to_user_ptr(arg.buf), arg.len))
+			ret = -EFAULT;
+		else
+			ret = ringbuf_send_wait(arg.chan, buf, arg.len, 0, 0);
+		kfree(buf);
+		if(ret >= 0)
+			ringbuf_file_count(f, true, arg.len);
+		return ret;
+	}
+
+	ret = ringbuf_msg_bind(arg.chan);
+	while(!ret) {
+		spin_lock_bh(&ringbuf_dev.recv_lock);
+		ret = ringbuf_recv(arg.chan, buf, arg.len, &hd,
+				arg.flags & RBIO_RAW);
+		spin_unlock_bh(&ringbuf_dev.recv_lock);
+		if(ret != -ENODATA)
+			break;
+
+		ret = -EAGAIN;
+		if(arg.flags & RBIO_NONBLOCK)
+			break;
+		ret = wait_event_interruptible(wait_queue,
+				ringbuf_readable(arg.chan));
+	}
+
+	if(ret > 0) {
+		arg.len = ret;
+		arg.raw_len = hd.raw_len;
+		arg.flags = (arg.flags & RBIO_RAW) ?
+				hd.flags & RBMSG_COMP_MASK : 0;
+		if(copy_to_user(u64_to_user_ptr(arg.buf), buf, arg.len) ||
+		   copy_to_user(uarg, &arg, sizeof(arg))) {
+			ret = -EFAULT;
+		} else {
+			ringbuf_file_count(f, false, arg.len);
+			ringbuf_lat_record(arg.chan, LatDeliver, hd.tstamp);
+		}
+	}
+	kfree(buf);
+
+	return ret;
+}
+
+/*
+ * hand up to budget messages of a ChanKernel channel to fn, with the
+ * payload in place unless it has to be decompressed first, with
+ * recv_lock held. Returns how many.
+ */
+static int ringbuf_kchan_deliver(unsigned int chan, ringbuf_recv_fn fn,
+				void *priv, int budget)
+{
+	const char *payload;
+	rbmsg_hd hd;
+	ssize_t len;
+	int slot, n = 0;
+
+	/* what a ChanMsg reader left queued comes first */
+	while(n < budget && (payload = ringbuf_next(chan, &hd, &slot))) {
+		len = hd.payload_len;
+		if(hd.flags & RBMSG_COMP_MASK) {
+			len = ringbuf_decode(payload, &hd, ringbuf_dev.decomp_buf,
+				ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS,
+				false);
+			payload = ringbuf_dev.decomp_buf;
+		}
+		if(len >= 0)
+			fn(priv, payload, len, hd.src_qid, hd.tstamp);
+		ringbuf_done(chan, slot, &hd);
+		ringbuf_lat_record(chan, LatDeliver, hd.tstamp);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * hand the messages of a ChanKernel channel to the callback of the
+ * module receiving it, or tell it they are there if it polls them,
+ * from the tasklet
+ */
+static void ringbuf_kchan_drain(unsigned int chan)
+{
+	struct ringbuf_chan *rc;
+
+	spin_lock(&ringbuf_dev.recv_lock);
+	rc = ringbuf_dev.kchan[chan];
+	if(rc && rc->recv)
+		ringbuf_kchan_deliver(chan, rc->recv, rc->priv, INT_MAX);
+	/* what a ChanMsg reader left queued counts as arrived */
+	else if(rc && ringbuf_readable(chan))
+		rc->arrival(rc->priv);
+	spin_unlock(&ringbuf_dev.recv_lock);
+}
+
+/*
+ * tell the handles whose nonblocking sends found their channel full
+ * that it may have room again, from the interrupt handler and the
+ * heartbeat in case the doorbell was missed
+ */
+static void ringbuf_kchan_space(void)
+{
+	struct ringbuf_chan *rc;
+	unsigned long flags, armed;
+	unsigned int chan;
+
+	if(!READ_ONCE(ringbuf_dev.kspace_armed))
+		return;
+
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	armed = xchg(&ringbuf_dev.kspace_armed, 0);
+	for_each_set_bit(chan, &armed, RINGBUF_MAX_CHANNELS) {
+		rc = ringbuf_dev.kspace[chan];
+		if(rc)
+			rc->space(rc->priv);
+	}
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+}
+
+/* ask the consumer of a full channel to ring us back once it has room */
+static void ringbuf_kchan_arm(struct ringbuf_chan *rc)
+{
+	rbring *ring = ringbuf_ring(rc->chan);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	if(ringbuf_dev.kspace[rc->chan] == rc) {
+		set_bit(rc->chan, &ringbuf_dev.kspace_armed);
+		ringbuf_want_room(ring);
+	}
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+}
+
+/*
+ * make a handle the consumer of its channel, either handed each message
+ * or told of arrivals to poll them
+ */
+static int ringbuf_kchan_bind(struct ringbuf_chan *rc, ringbuf_recv_fn recv,
+				ringbuf_notify_fn arrival, void *priv)
+{
+	unsigned int mode;
+	int ret = -EBUSY;
+
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	mode = ringbuf_dev.chan_mode[rc->chan];
+	if(mode == ChanNone || mode == ChanMsg) {
+		rc->recv = recv;
+		rc->arrival = arrival;
+		rc->priv = priv;
+		rc->prev_mode = mode;
+		ringbuf_dev.kchan[rc->chan] = rc;
+		set_bit(rc->chan, &ringbuf_dev.kchan_mask);
+		ret = ringbuf_chan_bind(rc->chan, ChanKernel);
+	}
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+	if(!ret)
+		tasklet_schedule(&read_msg_tasklet);
+
+	return ret;
+}
+
+static int ringbuf_kchan_check(size_t len)
+{
+	if(!ringbuf_dev.dev)
+		return -ENODEV;
+	if(ringbuf_dev.peer_slot < 0)
+		return -ENOTCONN;
+	if(len > ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS)
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/*
+ * in-kernel interface, see ringbuf.h. A handle sends from any context
+ * but hard interrupts with RINGBUF_NONBLOCK, and may sleep without.
+ */
+struct ringbuf_chan *ringbuf_chan_open(unsigned int chan)
+{
+	struct ringbuf_chan *rc;
+
+	if(chan >= RINGBUF_MAX_CHANNELS)
+		return ERR_PTR(-EINVAL);
+	if(!ringbuf_dev.dev)
+		return ERR_PTR(-ENODEV);
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	if(!rc)
+		return ERR_PTR(-ENOMEM);
+	rc->chan = chan;
+
+	return rc;
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_open);
+
+/* give the channel back to how it was consumed before, if it received */
+void ringbuf_chan_close(struct ringbuf_chan *rc)
+{
+	unsigned long flags;
+
+	if(IS_ERR_OR_NULL(rc))
+		return;
+
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	if(ringbuf_dev.kchan[rc->chan] == rc) {
+		ringbuf_dev.kchan[rc->chan] = NULL;
+		clear_bit(rc->chan, &ringbuf_dev.kchan_mask);
+		if(rc->prev_mode == ChanNone)
+			ringbuf_chan_unbind(rc->chan);
+		else
+			ringbuf_dev.chan_mode[rc->chan] = rc->prev_mode;
+	}
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	if(ringbuf_dev.kspace[rc->chan] == rc) {
+		ringbuf_dev.kspace[rc->chan] = NULL;
+		clear_bit(rc->chan, &ringbuf_dev.kspace_armed);
+	}
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+
+	kfree(rc);
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_close);
+
+ssize_t ringbuf_chan_sendv(struct ringbuf_chan *rc, const struct kvec *iov,
+				unsigned int n, unsigned int flags)
+{
+	ssize_t ret;
+
+	ret = ringbuf_kchan_check(ringbuf_iov_len(iov, n));
+	if(ret)
+		return ret;
+	if(!(flags & RINGBUF_NONBLOCK))
+		return ringbuf_sendv_wait(rc->chan, iov, n, 0, 0);
+
+	ret = ringbuf_sendv_try(rc->chan, iov, n);
+	if(ret == -ENOBUFS) {
+		ringbuf_kchan_arm(rc);
+		ret = -EAGAIN;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_sendv);
+
+ssize_t ringbuf_chan_send(struct ringbuf_chan *rc, const void *buf,
+				size_t len, unsigned int flags)
+{
+	struct kvec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return ringbuf_chan_sendv(rc, &iov, 1, flags);
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_send);
+
+/*
+ * send messages back to back under one hold of lane_lock and write_lock,
+ * and ring the consumer once. Without RINGBUF_NONBLOCK, what did not fit is sent one
+ * by one as the channel policy says. Returns the messages sent, or the
+ * error of the first one.
+ */
+int ringbuf_chan_send_batch(struct ringbuf_chan *rc, const struct kvec *msgs,
+				unsigned int n, unsigned int flags)
+{
+	unsigned int i;
+	ssize_t ret = 0;
+
+	for(i = 0; i < n; i++) {
+		ret = ringbuf_kchan_check(msgs[i].iov_len);
+		if(ret)
+			return ret;
+	}
+
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	ringbuf_lock_batch();
+	for(i = 0; i < n; i++) {
+		ret = ringbuf_send(rc->chan, msgs[i].iov_base, msgs[i].iov_len,
+					0, 0);
+		if(ret < 0)
+			break;
+	}
+	ringbuf_unlock_batch();
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	if(i)
+		ringbuf_kick(rc->chan);
+	ringbuf_event_space(rc->chan);
+
+	if(i < n && (flags & RINGBUF_NONBLOCK)) {
+		RINGBUF_STAT_INC(ring_full);
+		ringbuf_kchan_arm(rc);
+		if(ret == -ENOBUFS)
+			ret = -EAGAIN;
+	}
+	for(; i < n && !(flags & RINGBUF_NONBLOCK); i++) {
+		ret = ringbuf_send_wait(rc->chan, msgs[i].iov_base,
+					msgs[i].iov_len, 0, 0);
+		if(ret < 0)
+			break;
+	}
+
+	return i ? i : ret;
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_send_batch);
+
+/*
+ * consume the channel here, handing each message to fn from the tasklet,
+ * starting with those already waiting. -EBUSY if RPCs or another module
+ * consume it.
+ */
+int ringbuf_chan_recv(struct ringbuf_chan *rc, ringbuf_recv_fn fn,
+				void *priv)
+{
+	if(!fn)
+		return -EINVAL;
+	if(!ringbuf_dev.dev)
+		return -ENODEV;
+
+	return ringbuf_kchan_bind(rc, fn, NULL, priv);
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_recv);
+
+/*
+ * have arrival called from the tasklet when the channel has messages to
+ * ringbuf_chan_poll(), which consumes it here like ringbuf_chan_recv(),
+ * and space from the interrupt handler once a nonblocking send that
+ * found it full may go again. Either may be NULL.
+ */
+int ringbuf_chan_notify(struct ringbuf_chan *rc, ringbuf_notify_fn arrival,
+				ringbuf_notify_fn space, void *priv)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	if(!arrival && !space)
+		return -EINVAL;
+	if(!ringbuf_dev.dev)
+		return -ENODEV;
+
+	if(space) {
+		spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+		if(ringbuf_dev.kspace[rc->chan] &&
+		   ringbuf_dev.kspace[rc->chan] != rc) {
+			ret = -EBUSY;
+		} else {
+			rc->space = space;
+			rc->priv = priv;
+			ringbuf_dev.kspace[rc->chan] = rc;
+		}
+		spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+	}
+	if(!ret && arrival)
+		ret = ringbuf_kchan_bind(rc, NULL, arrival, priv);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_notify);
+
+/*
+ * hand up to budget messages of a channel the handle consumes to fn,
+ * from any context but hard interrupts. Returns how many.
+ */
+int ringbuf_chan_poll(struct ringbuf_chan *rc, ringbuf_recv_fn fn,
+				void *priv, int budget)
+{
+	int ret = -EINVAL;
+
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	if(ringbuf_dev.kchan[rc->chan] == rc && budget > 0)
+		ret = ringbuf_kchan_deliver(rc->chan, fn, priv, budget);
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ringbuf_chan_poll);
+
+u32 ringbuf_ivposition(void)
+{
+	return ringbuf_dev.ivposition;
+}
+EXPORT_SYMBOL_GPL(ringbuf_ivposition);
+
+/* longest message a channel takes, 0 without a device */
+size_t ringbuf_msg_max(void)
+{
+	return ringbuf_dev.dev ? ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS : 0;
+}
+EXPORT_SYMBOL_GPL(ringbuf_msg_max);
+
+/*
+ * IOCTL_COMPRESS: compress what we send to a channel from now on. The
+ * workspace of an algorithm is allocated the first time it is asked for
+ * and kept until the module goes.
+ */
+static long ringbuf_compress_ioctl(rbcompress __user *uarg)
+{
+	rbcompress arg;
+	void *wrkmem = NULL, **slot = NULL;
+	size_t sz = 0;
+#ifdef RINGBUF_ZSTD
+	zstd_parameters params = zstd_get_params(ZSTD_LEVEL,
+			ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS);
+#endif
+
+	if(copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if(arg.chan >= RINGBUF_MAX_CHANNELS || arg.algo > CompZstd)
+		return -EINVAL;
+
+	switch(arg.algo) {
+	case CompNone:
+		break;
+#ifdef RINGBUF_LZ4
+	case CompLz4:
+		slot = &ringbuf_dev.lz4_wrkmem;
+		sz = LZ4_MEM_COMPRESS;
+		break;
+#endif
+#ifdef RINGBUF_ZSTD
+	case CompZstd:
+		slot = &ringbuf_dev.zstd_wrkmem;
+		sz = zstd_cctx_workspace_bound(&params.cParams);
+		break;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if(slot && !READ_ONCE(*slot)) {
+		wrkmem = vzalloc(sz);
+		if(!wrkmem)
+			return -ENOMEM;
+	}
+
+	spin_lock_bh(&ringbuf_dev.lane_lock);
+	if(wrkmem && !*slot) {
+		*slot = wrkmem;
+		wrkmem = NULL;
+#ifdef RINGBUF_ZSTD
+		if(arg.algo == CompZstd) {
+			ringbuf_dev.zstd_params = params;
+			ringbuf_dev.zstd_cctx = zstd_init_cctx(*slot, sz);
+		}
+#endif
+	}
+	ringbuf_dev.comp_algo[arg.chan] = arg.algo;
+	ringbuf_dev.comp_threshold[arg.chan] = arg.threshold;
+	spin_unlock_bh(&ringbuf_dev.lane_lock);
+
+	vfree(wrkmem);
+
+	return 0;
+}
+
+/*
+ * dispatch the replies arrived on our reply channel to their calls.
+ * The payload goes straight from IVshmem space into the reply buffer
+ * of the call, replies nobody waits for anymore are dropped.
+ */
+static void ringbuf_rpc_complete(unsigned int chan)
+{
+	rbmsg_hd hd;
+	rbrpc_call *call;
+	bool found;
+	ssize_t ret;
+	int slot;
+
+	spin_lock(&ringbuf_dev.recv_lock);
+	while((slot = ringbuf_peek(chan, &hd)) >= 0) {
+		found = false;
+
+		if(hd.flags & RBMSG_RPC_REP) {
+			spin_lock(&ringbuf_dev.rpc_lock);
+			list_for_each_entry(call, &ringbuf_dev.rpc_calls, list) {
+				if(call->corr_id != hd.corr_id || call->done)
+					continue;
+				ret = ringbuf_payload(chan, &hd, call->rep,
+							call->rep_len, false);
+				call->rep_len = ret < 0 ? 0 : ret;
+				call->done = true;
+				found = true;
+				break;
+			}
+			spin_unlock(&ringbuf_dev.rpc_lock);
+		}
+
+		if(!found)
+			printk(KERN_WARNING "ringbuf: dropped reply %u from peer %u\n",
+				hd.corr_id, hd.src_qid);
+		ringbuf_consume(chan, slot, &hd);
+	}
+	spin_unlock(&ringbuf_dev.recv_lock);
+
+	wake_up_interruptible(&rpc_wait);
+}
+
+static void ringbuf_rpc_free(rbrpc_call *call)
+{
+	kfree(call->rep);
+	kfree(call);
+}
+
+/*
+ * send a request to the service bound to arg->chan, and queue the call
+ * waiting for its reply
+ */
+static rbrpc_call *ringbuf_rpc_submit(rbrpc *arg, bool sync)
+{
+	rbrpc_call *call;
+	char *req;
+	ssize_t ret;
+
+	if(ringbuf_dev.rpc_reply_chan < 0)
+		return ERR_PTR(-ENOTCONN);
+	if(arg->chan >= RINGBUF_MAX_CHANNELS || arg->len > RINGBUF_RPC_MAX_SZ ||
+	   arg->rlen > RINGBUF_RPC_MAX_SZ)
+		return ERR_PTR(-EINVAL);
+
+	call = kzalloc(sizeof(*call), GFP_KERNEL);
+	req = kmalloc(arg->len, GFP_KERNEL);
+	if(call)
+		call->rep = kmalloc(arg->rlen, GFP_KERNEL);
+	if(!call || !req || !call->rep) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	if(copy_from_user(req, u64_to_user_ptr(arg->buf), arg->len)) {
+		ret = -EFAULT;
+		goto err;
+	}
+
+	call->corr_id = atomic_inc_return(&ringbuf_dev.rpc_corr);
+	call->sync = sync;
+	call->rep_len = arg->rlen;
+
+	spin_lock_bh(&ringbuf_dev.rpc_lock);
+	list_add_tail(&call->list, &ringbuf_dev.rpc_calls);
+	spin_unlock_bh(&ringbuf_dev.rpc_lock);
+
+	ret = ringbuf_send_wait(arg->chan, req, arg->len, RBMSG_RPC_REQ
+			| (ringbuf_dev.rpc_reply_chan << 8), call->corr_id);
+	kfree(req);
+	if(ret < 0) {
+		spin_lock_bh(&ringbuf_dev.rpc_lock);
+		list_del(&call->list);
+		spin_unlock_bh(&ringbuf_dev.rpc_lock);
+		ringbuf_rpc_free(call);
+		return ERR_PTR(ret);
+	}
+
+	arg->corr_id = call->corr_id;
+	return call;
+
+err:
+	kfree(req);
+	if(call)
+		ringbuf_rpc_free(call);
+	return ERR_PTR(ret);
+}
+
+/*
+ * take a completed call off the list, by correlation ID or the first
+ * one completed if corr_id is 0
+ */
+static rbrpc_call *ringbuf_rpc_take(unsigned int corr_id)
+{
+	rbrpc_call *call, *ret = NULL;
+
+	spin_lock_bh(&ringbuf_dev.rpc_lock);
+	list_for_each_entry(call, &ringbuf_dev.rpc_calls, list) {
+		if(!call->done || call->sync ||
+		   (corr_id && call->corr_id != corr_id))
+			continue;
+		list_del(&call->list);
+		ret = call;
+		break;
+	}
+	spin_unlock_bh(&ringbuf_dev.rpc_lock);
+
+	return ret;
+}
+
+static bool ringbuf_rpc_pending(void)
+{
+	rbrpc_call *call;
+	bool ret = false;
+
+	spin_lock_bh(&ringbuf_dev.rpc_lock);
+	list_for_each_entry(call, &ringbuf_dev.rpc_calls, list)
+		ret |= call->done && !call->sync;
+	spin_unlock_bh(&ringbuf_dev.rpc_lock);
+
+	return ret;
+}
+
+static long ringbuf_rpc_ioctl(unsigned int cmd, rbrpc __user *uarg)
+{
+	rbrpc arg;
+	rbrpc_call *call;
 	rbmsg_hd hd;
-	unsigned int msgsent_len;
-	fifo* fifo_addr = ringbuf_dev.fifo_addr;
+	char *buf;
+	int slot;
+	long ret = 0;
+
+	if(copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	switch(cmd) {
+	case IOCTL_RPC_SUBMIT:
+		call = ringbuf_rpc_submit(&arg, false);
+		if(IS_ERR(call))
+			return PTR_ERR(call);
+		break;
+
+	case IOCTL_RPC_CALL:
+		call = ringbuf_rpc_submit(&arg, true);
+		if(IS_ERR(call))
+			return PTR_ERR(call);
+		ret = wait_event_interruptible(rpc_wait, READ_ONCE(call->done));
+		if(ret < 0) {
+			/* the reply will find no call and be dropped */
+			spin_lock_bh(&ringbuf_dev.rpc_lock);
+			list_del(&call->list);
+			spin_unlock_bh(&ringbuf_dev.rpc_lock);
+			ringbuf_rpc_free(call);
+			return ret;
+		}
+		spin_lock_bh(&ringbuf_dev.rpc_lock);
+		list_del(&call->list);
+		spin_unlock_bh(&ringbuf_dev.rpc_lock);
+		goto copy_reply;
+
+	case IOCTL_RPC_COMPLETE:
+		call = ringbuf_rpc_take(arg.corr_id);
+		if(!call)
+			return -EAGAIN;
+		arg.corr_id = call->corr_id;
+
+copy_reply:
+		arg.rlen = call->rep_len;
+		if(copy_to_user(u64_to_user_ptr(arg.rbuf), call->rep, arg.rlen))
+			ret = -EFAULT;
+		ringbuf_rpc_free(call);
+		break;
+
+	case IOCTL_RPC_RECV:
+		if(arg.chan >= RINGBUF_MAX_CHANNELS ||
+		   ringbuf_dev.chan_mode[arg.chan] != ChanRpcServer)
+			return -EINVAL;
+
+		ret = wait_event_interruptible(wait_queue,
+				READ_ONCE(ringbuf_ring(arg.chan)->head) !=
+				READ_ONCE(ringbuf_ring(arg.chan)->tail));
+		if(ret < 0)
+			return ret;
+
+		buf = kmalloc(RINGBUF_RPC_MAX_SZ, GFP_KERNEL);
+		if(!buf)
+			return -ENOMEM;
+
+		spin_lock_bh(&ringbuf_dev.recv_lock);
+		slot = ringbuf_peek(arg.chan, &hd);
+		if(slot < 0) {
+			spin_unlock_bh(&ringbuf_dev.recv_lock);
+			kfree(buf);
+			return -EAGAIN;
+		}
+		arg.corr_id = hd.corr_id;
+		arg.reply_chan = RBMSG_REPLY_CHAN(hd.flags);
+		ret = ringbuf_payload(arg.chan, &hd, buf,
+				MIN(arg.rlen, RINGBUF_RPC_MAX_SZ), false);
+		ringbuf_consume(arg.chan, slot, &hd);
+		spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+		if(ret >= 0) {
+			arg.rlen = ret;
+			ret = 0;
+			if(copy_to_user(u64_to_user_ptr(arg.rbuf), buf, arg.rlen))
+				ret = -EFAULT;
+			else
+				ringbuf_lat_record(arg.chan, LatDeliver,
+						hd.tstamp);
+		}
+		kfree(buf);
+		break;
+
+	case IOCTL_RPC_REPLY:
+		if(arg.chan >= RINGBUF_MAX_CHANNELS || arg.len > RINGBUF_RPC_MAX_SZ)
+			return -EINVAL;
+
+		buf = kmalloc(arg.len, GFP_KERNEL);
+		if(!buf)
+			return -ENOMEM;
+		if(copy_from_user(buf, u64_to_user_ptr(arg.buf), arg.len)) {
+			kfree(buf);
+			return -EFAULT;
+		}
+		ret = ringbuf_send_wait(arg.chan, buf, arg.len, RBMSG_RPC_REP,
+					arg.corr_id);
+		kfree(buf);
+		return ret < 0 ? ret : 0;
+	}
 
-	if(ringbuf_dev.role != Producer) {
-		printk(KERN_ERR "ringbuf: not allowed to write \n");
-		return 0;
+	if(!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/*
+ * readable when an async RPC has completed, when an RPC request is
+ * waiting on a channel we serve, or when a message channel has messages,
+ * writable when the tx channel of the file has a free slot
+ */
+static __poll_t ringbuf_fpoll(struct file *fp, poll_table *wait)
+{
+	rbfile *f = fp->private_data;
+	__poll_t mask = 0;
+	unsigned int chan;
+
+	poll_wait(fp, &rpc_wait, wait);
+	poll_wait(fp, &wait_queue, wait);
+
+	if(ringbuf_rpc_pending())
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		if(ringbuf_dev.chan_mode[chan] != ChanRpcServer &&
+		   ringbuf_dev.chan_mode[chan] != ChanMsg)
+			continue;
+		if(ringbuf_readable(chan))
+			mask |= EPOLLIN | EPOLLRDNORM;
 	}
-	if(!ringbuf_dev.base_addr || !fifo_addr) {
-		printk(KERN_ERR "ringbuf: cannot read from addr (NULL)\n");
-		return 0;
+
+	/* a full ring rings us back once its consumer made room */
+	chan = READ_ONCE(f->opts.tx_chan);
+	if(ringbuf_dev.chan_mode[chan] == ChanNone &&
+	   ringbuf_dev.peer_slot >= 0) {
+		if(ringbuf_writable(chan, 0, 1))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		else
+			ringbuf_want_room(ringbuf_ring(chan));
 	}
-	if(kfifo_avail(fifo_addr) < RINGBUF_MSG_SZ) {
-		printk(KERN_ERR "not enough space in ring buffer\n");
-		return 0;
+
+	return mask;
+}
+
+
+
+static inline void ringbuf_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/*
+ * signal the arrival eventfd of a channel if it has messages, returns
+ * whether one is registered
+ */
+static bool ringbuf_event_arrival(unsigned int chan)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	ret = ringbuf_dev.ev_arrival[chan] != NULL;
+	if (ret && ringbuf_readable(chan))
+		ringbuf_eventfd_signal(ringbuf_dev.ev_arrival[chan]);
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+
+	return ret;
+}
+
+/*
+ * signal the space eventfd of a channel once it has crossed back above
+ * its threshold. Below it, ask the consumer to ring us back on vector 0
+ * when it consumes, as a blocked producer does.
+ */
+static void ringbuf_event_space(unsigned int chan)
+{
+	rbring *ring = ringbuf_ring(chan);
+	unsigned long flags;
+	unsigned int used;
+
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	if (!ringbuf_dev.ev_space[chan] || ringbuf_dev.peer_slot < 0)
+		goto out;
+
+	used = READ_ONCE(ring->head) - READ_ONCE(ring->tail);
+	if (RINGBUF_SLOTS - used >= ringbuf_dev.ev_space_thresh[chan]) {
+		if (test_and_clear_bit(chan, &ringbuf_dev.ev_space_armed))
+			ringbuf_eventfd_signal(ringbuf_dev.ev_space[chan]);
+	} else {
+		set_bit(chan, &ringbuf_dev.ev_space_armed);
+		ringbuf_want_room(ring);
 	}
+out:
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
+}
 
-	hd.src_qid = QEMU_PROCESS_ID;
-	hd.payload_off = payload_pt;
-	hd.payload_len = len;
-	memcpy(ringbuf_dev.payloads_st + hd.payload_off, buffer, len);
+/*
+ * IOCTL_EVENTFD: (un)register the arrival or space eventfd of a channel.
+ * Watching arrivals on a channel nobody consumes here binds it, and its
+ * messages are then left to read() or io_uring instead of the log.
+ */
+static long ringbuf_event_register(rbevent __user *arg)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	struct eventfd_ctx **slot;
+	unsigned long flags;
+	rbevent ev;
+	int ret;
 
-	wmb();
+	if(copy_from_user(&ev, arg, sizeof(ev)))
+		return -EFAULT;
+	if(ev.chan >= RINGBUF_MAX_CHANNELS)
+		return -EINVAL;
+	if(ev.flags == RBEVENT_SPACE &&
+	   (!ev.threshold || ev.threshold > RINGBUF_SLOTS))
+		return -EINVAL;
+	if(ev.flags != RBEVENT_ARRIVAL && ev.flags != RBEVENT_SPACE)
+		return -EINVAL;
+
+	if(ev.fd >= 0) {
+		ctx = eventfd_ctx_fdget(ev.fd);
+		if(IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	if(ev.flags == RBEVENT_ARRIVAL && ctx &&
+	   ringbuf_dev.chan_mode[ev.chan] == ChanNone) {
+		ret = ringbuf_chan_bind(ev.chan, ChanMsg);
+		if(ret) {
+			eventfd_ctx_put(ctx);
+			return ret;
+		}
+	}
 
-	spin_lock(ringbuf_dev.write_lock);
-	fifo_addr->kfifo.data = (void*)fifo_addr + 0x18;
+	spin_lock_irqsave(&ringbuf_dev.ev_lock, flags);
+	if(ev.flags == RBEVENT_ARRIVAL) {
+		slot = &ringbuf_dev.ev_arrival[ev.chan];
+	} else {
+		slot = &ringbuf_dev.ev_space[ev.chan];
+		ringbuf_dev.ev_space_thresh[ev.chan] = ev.threshold;
+		set_bit(ev.chan, &ringbuf_dev.ev_space_armed);
+	}
+	old = *slot;
+	*slot = ctx;
+	spin_unlock_irqrestore(&ringbuf_dev.ev_lock, flags);
 
-	mb();
+	if(old)
+		eventfd_ctx_put(old);
 
-	msgsent_len = kfifo_in(fifo_addr, (char*)&hd, RINGBUF_MSG_SZ);
-	spin_unlock(ringbuf_dev.write_lock);
+	/* report what is already there, like poll() would */
+	if(ev.flags == RBEVENT_ARRIVAL)
+		tasklet_schedule(&read_msg_tasklet);
+	else
+		ringbuf_event_space(ev.chan);
 
-	if(msgsent_len != RINGBUF_MSG_SZ) {
-		printk(KERN_ERR "ring buffer msg incomplete! only %d sent\n", msgsent_len);
-		goto err;
+	return 0;
+}
+
+/*
+ * drop every registered eventfd
+ */
+static void ringbuf_event_exit(void)
+{
+	unsigned int chan;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		if(ringbuf_dev.ev_arrival[chan])
+			eventfd_ctx_put(ringbuf_dev.ev_arrival[chan]);
+		if(ringbuf_dev.ev_space[chan])
+			eventfd_ctx_put(ringbuf_dev.ev_space[chan]);
+		ringbuf_dev.ev_arrival[chan] = NULL;
+		ringbuf_dev.ev_space[chan] = NULL;
+	}
+	ringbuf_dev.ev_space_armed = 0;
+}
+
+/*
+ * fill the bounce buffer of an io_uring receive from a channel, with
+ * recv_lock held. Returns the bytes filled or -ENODATA.
+ */
+static ssize_t ringbuf_uring_fill(rburing_req *req)
+{
+	const char *src;
+	rbmsg_hd hd;
+	ssize_t ret;
+	u32 msg_len, off = 0;
+	int slot;
+
+	if(req->op == RINGBUF_URING_RECV) {
+		ret = ringbuf_recv(req->chan, req->kbuf, req->len, &hd, false);
+		req->tstamp = hd.tstamp;
+		return ret;
+	}
+
+	while((src = ringbuf_next(req->chan, &hd, &slot))) {
+		msg_len = (hd.flags & RBMSG_COMP_MASK) ?
+				hd.raw_len : hd.payload_len;
+		if(off + sizeof(u32) + msg_len > req->len)
+			break;
+
+		/* a message that does not decompress is left out */
+		ret = ringbuf_decode(src, &hd,
+				req->kbuf + off + sizeof(u32), msg_len, false);
+		ringbuf_done(req->chan, slot, &hd);
+		if(ret < 0)
+			continue;
+
+		if(!off)
+			req->tstamp = hd.tstamp;
+		memcpy(req->kbuf + off, &msg_len, sizeof(u32));
+		off = ALIGN(off + sizeof(u32) + msg_len, sizeof(u32));
+	}
+
+	ret = off ? off : -ENODATA;
+	if(ret == -ENODATA && slot >= 0)
+		ret = -EMSGSIZE;
+
+	return ret;
+}
+
+#ifdef RINGBUF_URING_CMD
+static inline const rburing_cmd *ringbuf_uring_sqe(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	return (const rburing_cmd *)ioucmd->cmd;
+#endif
+}
+
+static inline void ringbuf_uring_done(struct io_uring_cmd *ioucmd,
+				ssize_t ret, unsigned int issue_flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+#else
+	io_uring_cmd_done(ioucmd, ret, 0);
+#endif
+}
+
+static inline rburing_req *ringbuf_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	return *(rburing_req **)ioucmd->pdu;
+}
+
+/*
+ * back in the submitting task: copy what the tasklet received to the
+ * user buffer and post the CQE
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static void ringbuf_uring_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+#else
+static void ringbuf_uring_task(struct io_uring_cmd *ioucmd)
+#endif
+{
+	rburing_req *req = ringbuf_uring_pdu(ioucmd);
+	ssize_t ret = req->res;
+
+	if(ret > 0 && copy_to_user(u64_to_user_ptr(req->ubuf), req->kbuf, ret))
+		ret = -EFAULT;
+	if(ret > 0)
+		ringbuf_lat_record(req->chan, LatDeliver, req->tstamp);
+
+	kfree(req->kbuf);
+	kfree(req);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	ringbuf_uring_done(ioucmd, ret, issue_flags);
+#else
+	ringbuf_uring_done(ioucmd, ret, 0);
+#endif
+}
+
+static void ringbuf_uring_post(rburing_req *req)
+{
+	io_uring_cmd_complete_in_task(req->ioucmd, ringbuf_uring_task);
+}
+
+/* chan, len and ubuf are read once from the SQE by ringbuf_uring_cmd() */
+static int ringbuf_uring_recv(struct io_uring_cmd *ioucmd, unsigned int chan,
+		u32 len, u64 ubuf, unsigned int issue_flags)
+{
+	rburing_req *req;
+	ssize_t ret;
+
+	if(chan >= RINGBUF_MAX_CHANNELS || !len ||
+	   ringbuf_dev.chan_mode[chan] != ChanMsg)
+		return -EINVAL;
+
+	len = MIN(len, ringbuf_dev.arena_sz);
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if(!req)
+		return -ENOMEM;
+	req->kbuf = kmalloc(len, GFP_KERNEL);
+	if(!req->kbuf) {
+		kfree(req);
+		return -ENOMEM;
+	}
+	req->ioucmd = ioucmd;
+	req->filp = ioucmd->file;
+	req->op = ioucmd->cmd_op;
+	req->chan = chan;
+	req->ubuf = ubuf;
+	req->len = len;
+	*(rburing_req **)ioucmd->pdu = req;
+
+	/* complete right away if nobody queued before us and data is there */
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	ret = -ENODATA;
+	if(list_empty(&ringbuf_dev.uring_recv[req->chan]))
+		ret = ringbuf_uring_fill(req);
+	if(ret == -ENODATA)
+		list_add_tail(&req->list, &ringbuf_dev.uring_recv[req->chan]);
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+	if(ret == -ENODATA) {
+#ifdef RINGBUF_URING_CANCEL
+		/* the ring going away or the task exiting calls us back */
+		io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+#endif
+		return -EIOCBQUEUED;
+	}
+
+	if(ret > 0 && copy_to_user(u64_to_user_ptr(req->ubuf), req->kbuf, ret))
+		ret = -EFAULT;
+	if(ret > 0)
+		ringbuf_lat_record(req->chan, LatDeliver, req->tstamp);
+	kfree(req->kbuf);
+	kfree(req);
+
+	return ret;
+}
+
+#ifdef RINGBUF_URING_CANCEL
+/*
+ * io_uring cancels a queued receive. One the tasklet already took off
+ * the queue is completed by its task work instead.
+ */
+static int ringbuf_uring_recv_cancel(struct io_uring_cmd *ioucmd,
+				unsigned int issue_flags)
+{
+	rburing_req *req, *found = NULL;
+	unsigned int chan;
+
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS && !found; chan++) {
+		list_for_each_entry(req, &ringbuf_dev.uring_recv[chan], list) {
+			if(req->ioucmd == ioucmd) {
+				list_del(&req->list);
+				found = req;
+				break;
+			}
+		}
+	}
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+
+	if(found) {
+		kfree(found->kbuf);
+		kfree(found);
+		ringbuf_uring_done(ioucmd, -ECANCELED, issue_flags);
 	}
 
-	ringbuf_ioctl(NULL, IOCTL_RING, 1);
-	payload_pt += len;
 	return 0;
+}
+#endif
 
-err:
-	return -EFAULT;
+/*
+ * io_uring passthrough: RINGBUF_URING_SEND completes inline, a receive
+ * completes inline if a message is there and is queued otherwise, to be
+ * completed by the tasklet when messages land. The SQE stays writable
+ * by userspace, its fields are read once and only the copies are used.
+ */
+static int ringbuf_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	const rburing_cmd *cmd;
+	unsigned int chan;
+	char *buf;
+	ssize_t ret;
+	u64 ubuf;
+	u32 len;
+
+#ifdef RINGBUF_URING_CANCEL
+	if (issue_flags & IO_URING_F_CANCEL)
+		return ringbuf_uring_recv_cancel(ioucmd, issue_flags);
+#endif
+	cmd = ringbuf_uring_sqe(ioucmd);
+	chan = READ_ONCE(cmd->chan);
+	len = READ_ONCE(cmd->len);
+	ubuf = READ_ONCE(cmd->buf);
+
+	switch(ioucmd->cmd_op) {
+	case RINGBUF_URING_SEND:
+		if(chan >= RINGBUF_MAX_CHANNELS || !len ||
+		   len > ringbuf_dev.arena_sz / RINGBUF_MAX_CHANNELS)
+			return -EINVAL;
+		/* a full ring may sleep, let io-wq retry us in blocking mode */
+		if((issue_flags & IO_URING_F_NONBLOCK) &&
+		   READ_ONCE(ringbuf_ring(chan)->policy) == PolicyBlock &&
+		   !ringbuf_writable(chan, len, 1))
+			return -EAGAIN;
+
+		buf = kmalloc(len, GFP_KERNEL);
+		if(!buf)
+			return -ENOMEM;
+		if(copy_from_user(buf, u64_to_user_ptr(ubuf), len)) {
+			kfree(buf);
+			return -EFAULT;
+		}
+		ret = ringbuf_send_wait(chan, buf, len, 0, 0);
+		kfree(buf);
+		return ret;
+
+	case RINGBUF_URING_RECV:
+	case RINGBUF_URING_RECV_BATCH:
+		return ringbuf_uring_recv(ioucmd, chan, len, ubuf, issue_flags);
+
+	default:
+		return -EINVAL;
+	}
+}
+#endif
+
+/*
+ * complete the io_uring receives queued on a channel, in order, for as
+ * long as there are messages. Called by the tasklet.
+ */
+static void ringbuf_uring_drain(unsigned int chan)
+{
+#ifdef RINGBUF_URING_CMD
+	rburing_req *req;
+	ssize_t ret;
+
+	spin_lock(&ringbuf_dev.recv_lock);
+	while(!list_empty(&ringbuf_dev.uring_recv[chan])) {
+		req = list_first_entry(&ringbuf_dev.uring_recv[chan],
+					rburing_req, list);
+		ret = ringbuf_uring_fill(req);
+		if(ret == -ENODATA)
+			break;
+
+		list_del(&req->list);
+		req->res = ret;
+		ringbuf_uring_post(req);
+	}
+	spin_unlock(&ringbuf_dev.recv_lock);
+#endif
+}
+
+/*
+ * fail the io_uring receives still queued on a file when it is released,
+ * or on any file (NULL) when the device goes away
+ */
+static void ringbuf_uring_cancel(struct file *filp)
+{
+#ifdef RINGBUF_URING_CMD
+	rburing_req *req, *tmp;
+	unsigned int chan;
+
+	spin_lock_bh(&ringbuf_dev.recv_lock);
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		list_for_each_entry_safe(req, tmp, &ringbuf_dev.uring_recv[chan],
+									list) {
+			if(filp && req->filp != filp)
+				continue;
+			list_del(&req->list);
+			req->res = -ECANCELED;
+			ringbuf_uring_post(req);
+		}
+	}
+	spin_unlock_bh(&ringbuf_dev.recv_lock);
+#endif
 }
 
 
 
 static int ringbuf_open(struct inode * inode, struct file * filp)
 {
+	rbfile *f;
 
 	printk(KERN_INFO "Opening ringbuf device\n");
 
@@ -409,7 +3984,12 @@ static int ringbuf_open(struct inode * inode, struct file * filp)
 				RINGBUF_DEVICE_MINOR_NR);
 		return -ENODEV;
 	}
-	filp->private_data = (void*)(&ringbuf_dev);
+
+	/* channel 0 both ways, as before files had settings */
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	filp->private_data = f;
 	ringbuf_dev.minor = RINGBUF_DEVICE_MINOR_NR;
 
    return 0;
@@ -419,14 +3999,10 @@ static int ringbuf_open(struct inode * inode, struct file * filp)
 
 static int ringbuf_release(struct inode * inode, struct file * filp)
 {
-	if(ringbuf_dev.fifo_addr != NULL) {
-		//TODO: free the payloads linklist
-		payload_pt = 0;
-		printk(KERN_INFO "ring buffer is being freed");
-		kfifo_free(ringbuf_dev.fifo_addr);
-	}
-
+	/* the rings live in IVshmem space and outlive any file */
 	printk(KERN_INFO "release ringbuf_device\n");
+	ringbuf_uring_cancel(filp);
+	kfree(filp->private_data);
 
    	return 0;
 }
@@ -437,6 +4013,7 @@ static int ringbuf_probe_device (struct pci_dev *pdev,
 {
 
 	int ret;
+	unsigned int i;
 	struct ringbuf_device *dev = &ringbuf_dev;
 	printk(KERN_INFO "probing for device\n");
 
@@ -479,28 +4056,33 @@ static int ringbuf_probe_device (struct pci_dev *pdev,
 		goto release_regions;
 	}
 
-	dev->vec_tb = ioremap(dev->bar1_addr, dev->bar1_size);
-	if (!dev->vec_tb) {
-		printk(KERN_INFO "unable to ioremap bar1, sz: %d\n", 
-						dev->bar1_size);
-		goto release_regions;
-	}
-
-	dev->base_addr = ioremap(dev->bar2_addr, dev->bar2_size);
+	dev->base_addr = memremap(dev->bar2_addr, dev->bar2_size,
+					MEMREMAP_WB);
 	if (!dev->base_addr) {
-		printk(KERN_INFO "unable to ioremap bar2, sz: %d\n", 
+		printk(KERN_INFO "unable to memremap bar2, sz: %d\n", 
 						dev->bar2_size);
 		goto iounmap_bar0;
 	}
-	printk(KERN_INFO "BAR1 map: %p\n", dev->base_addr);
 	printk(KERN_INFO "BAR2 map: %p\n", dev->base_addr);
 
-	ringbuf_dev.fifo_addr = (fifo*)ringbuf_dev.base_addr;
-	ringbuf_dev.payloads_st = ringbuf_dev.base_addr 
-					+ sizeof(fifo) + RINGBUF_SZ;	
+	ringbuf_dev.super = (rbsuper*)ringbuf_dev.base_addr;
+	ringbuf_dev.rings = ringbuf_dev.base_addr + RINGBUF_SUPER_SZ;
+	ringbuf_dev.payloads_st = ringbuf_dev.rings
+				+ RINGBUF_MAX_CHANNELS * RINGBUF_RING_SZ;
 
-	ringbuf_dev.write_lock =
-		(spinlock_t *)(ringbuf_dev.base_addr + sizeof(fifo) + RINGBUF_SZ - 16);
+	ringbuf_dev.arena_sz = (dev->bar2_size - (ringbuf_dev.payloads_st
+				- ringbuf_dev.base_addr)) / RINGBUF_MAX_PEERS;
+
+	ringbuf_dev.write_lock = &ringbuf_dev.super->write_lock;
+
+	ret = ringbuf_comp_init();
+	if (ret != 0)
+		goto destroy_device;
+
+	rbcopy_init(&dev->copy, COPY_ENGINE, COPY_VEC_MIN, COPY_NT_MIN);
+	printk(KERN_INFO "copy engines: %s, %s from %zu bytes, nt from %zu\n",
+		rbcopy_names[dev->copy.small], rbcopy_names[dev->copy.large],
+		dev->copy.vec_min, dev->copy.nt_min);
 
 	dev->dev = pdev;
 	dev->role = ROLE;
@@ -512,23 +4094,79 @@ static int ringbuf_probe_device (struct pci_dev *pdev,
 		printk(KERN_INFO "device ivposition: %u, MSI-X: %s\n", 
 			dev->ivposition,
 			(dev->ivposition == 0) ? "no": "yes");
+	}
 
-		if (dev->ivposition != 0) {
-			ret = request_msix_vectors(dev, 4);
-			if (ret != 0) {
-				goto destroy_device;
-			}
+	/* all of it is ready before a doorbell can get to us */
+	dev->peer_slot = -1;
+	spin_lock_init(&dev->lane_lock);
+	INIT_LIST_HEAD(&dev->stage_backlog);
+	spin_lock_init(&dev->rpc_lock);
+	INIT_LIST_HEAD(&dev->rpc_calls);
+	spin_lock_init(&dev->recv_lock);
+	spin_lock_init(&dev->ev_lock);
+	for (i = 0; i < RINGBUF_MAX_CHANNELS; i++) {
+		INIT_LIST_HEAD(&dev->uring_recv[i]);
+		INIT_LIST_HEAD(&dev->deliv[i]);
+		dev->deliv_bytes[i] = 0;
+	}
+	atomic_set(&dev->rpc_corr, 0);
+	dev->rpc_reply_chan = -1;
+	memset(dev->chan_mode, 0, sizeof(dev->chan_mode));
+	if (dev->role == Consumer)
+		dev->chan_mode[0] = ChanMsg;
+	ret = ringbuf_attach();
+	if (ret != 0)
+		goto super_exit;
+
+	if (dev->revision == 1 && dev->ivposition != 0) {
+		ret = request_msix_vectors(dev, 4);
+		if (ret != 0) {
+			goto detach_peer;
 		}
+
+		/* the channels ringbuf_attach() bound get their own vector */
+		for (i = 0; i < RINGBUF_MAX_CHANNELS; i++)
+			if (dev->chan_mode[i] != ChanNone)
+				WRITE_ONCE(dev->super->chan[i].vector,
+						ringbuf_chan_vector(i));
 	}
 	printk(KERN_INFO "device probed\n");
 
-	ringbuf_fifo_init();
+	poll_workqueue = create_singlethread_workqueue("ringbuf_poll");
+	if (!poll_workqueue) {
+		ret = -ENOMEM;
+		goto free_vectors;
+	}
+	queue_delayed_work(poll_workqueue, &poll_work, 0);
+
+	/* pick up what was left in the ring while no consumer was bound */
+	if (dev->role == Consumer)
+		tasklet_schedule(&read_msg_tasklet);
+
+	/*
+	 * statistics are best effort, the device works without them. They
+	 * read BAR2, so they live as long as it is mapped.
+	 */
+	if (!proc_create_single("ringbuf", 0444, NULL, ringbuf_stats_show))
+		printk(KERN_WARNING "RINGBUF: cannot create /proc/ringbuf\n");
 
 	return 0;
 
+free_vectors:
+	if (dev->nvectors)
+		free_msix_vectors(dev);
+	tasklet_kill(&read_msg_tasklet);
+
+detach_peer:
+	ringbuf_peer_detach();
+
+super_exit:
+	ringbuf_super_exit();
+
 destroy_device:
     	dev->dev = NULL;
-    	iounmap(dev->base_addr);
+	ringbuf_comp_exit();
+    	memunmap(dev->base_addr);
 
 iounmap_bar0:
     	iounmap(dev->regs_addr);
@@ -548,27 +4186,339 @@ out:
 static void ringbuf_remove_device(struct pci_dev* pdev)
 {
 	struct ringbuf_device *dev = &ringbuf_dev;
+	rbrpc_call *call, *tmp;
 
 	printk(KERN_INFO "removing ivshmem device\n");
 
-	free_msix_vectors(dev);
+	/* waits for the readers that are in */
+	remove_proc_entry("ringbuf", NULL);
+	cancel_delayed_work_sync(&poll_work);
+	destroy_workqueue(poll_workqueue);
 
-	dev->dev = NULL;
+	ringbuf_peer_detach();
+	ringbuf_super_exit();
+	if (dev->nvectors)
+		free_msix_vectors(dev);
+	tasklet_kill(&read_msg_tasklet);
+	ringbuf_uring_cancel(NULL);
+	ringbuf_deliver_exit();
+	ringbuf_event_exit();
+
+	list_for_each_entry_safe(call, tmp, &dev->rpc_calls, list) {
+		list_del(&call->list);
+		ringbuf_rpc_free(call);
+	}
 
-	iounmap(dev->base_addr);
+	dev->dev = NULL;
+	ringbuf_comp_exit();
+
+	/* nothing points into BAR2 once it is gone */
+	dev->write_lock = NULL;
+	dev->super = NULL;
+	dev->rings = NULL;
+	dev->payloads_st = NULL;
+	memunmap(dev->base_addr);
+	dev->base_addr = NULL;
 	iounmap(dev->regs_addr);
 
 	pci_release_regions(pdev);
 	pci_disable_device(pdev);
+}
 
-	destroy_workqueue(poll_workqueue);
+
+
+/*
+ * what the consumer needs to decompress, allocated at probe since it
+ * decompresses from the tasklet
+ */
+static int ringbuf_comp_init(void)
+{
+#if defined(RINGBUF_LZ4) || defined(RINGBUF_ZSTD)
+	ringbuf_dev.decomp_buf = vmalloc(ringbuf_dev.arena_sz
+					/ RINGBUF_MAX_CHANNELS);
+	if(!ringbuf_dev.decomp_buf)
+		return -ENOMEM;
+#endif
+#ifdef RINGBUF_ZSTD
+	ringbuf_dev.zstd_dwrkmem = vzalloc(zstd_dctx_workspace_bound());
+	if(!ringbuf_dev.zstd_dwrkmem)
+		return -ENOMEM;
+	ringbuf_dev.zstd_dctx = zstd_init_dctx(ringbuf_dev.zstd_dwrkmem,
+					zstd_dctx_workspace_bound());
+#endif
+
+	return 0;
+}
+
+static void ringbuf_comp_exit(void)
+{
+	vfree(ringbuf_dev.lz4_wrkmem);
+	vfree(ringbuf_dev.zstd_wrkmem);
+	vfree(ringbuf_dev.zstd_dwrkmem);
+	vfree(ringbuf_dev.decomp_buf);
+	ringbuf_dev.lz4_wrkmem = NULL;
+	ringbuf_dev.zstd_wrkmem = NULL;
+	ringbuf_dev.zstd_dwrkmem = NULL;
+	ringbuf_dev.decomp_buf = NULL;
+	memset(ringbuf_dev.comp_algo, 0, sizeof(ringbuf_dev.comp_algo));
+}
+
+
+
+static unsigned int ringbuf_lat_bucket(u64 ns)
+{
+	unsigned int e;
+
+	if(ns < 2 * RBLAT_SUB)
+		return ns;
+
+	e = fls64(ns) - 1;
+	if(e > RBLAT_MAX_SHIFT)
+		return RBLAT_BUCKETS - 1;
+
+	return (e - RBLAT_SUB_BITS + 1) * RBLAT_SUB +
+		((ns >> (e - RBLAT_SUB_BITS)) & (RBLAT_SUB - 1));
+}
+
+/* largest value counted in a bucket */
+static u64 ringbuf_lat_value(unsigned int b)
+{
+	unsigned int e;
+
+	if(b < 2 * RBLAT_SUB)
+		return b;
+
+	e = b / RBLAT_SUB + RBLAT_SUB_BITS - 1;
+	return (((u64)RBLAT_SUB + b % RBLAT_SUB + 1) << (e - RBLAT_SUB_BITS)) - 1;
+}
+
+/*
+ * count the time since a message was sent, on this CPU and without
+ * locks: the consumer records from the tasklet and from read() alike
+ */
+static void ringbuf_lat_record(unsigned int chan, int kind, u64 tstamp)
+{
+	rblat_hist __percpu *h;
+	u64 now, ns, old, prev;
+
+	if(!ringbuf_lat[chan] || !tstamp)
+		return;
+
+	/* a clock running behind the producer's counts as no latency */
+	now = ktime_get_real_ns();
+	ns = now > tstamp ? now - tstamp : 0;
+
+	h = &ringbuf_lat[chan]->kind[kind];
+	this_cpu_inc(h->count[ringbuf_lat_bucket(ns)]);
+
+	old = this_cpu_read(h->max);
+	while(ns > old) {
+		prev = this_cpu_cmpxchg(h->max, old, ns);
+		if(prev == old)
+			break;
+		old = prev;
+	}
+}
+
+static void ringbuf_lat_show_kind(struct seq_file *m, unsigned int chan,
+				int kind, u64 *sum)
+{
+	static const unsigned int pct[] = { 5000, 9900, 9990 };
+	u64 total = 0, seen = 0, rank, max = 0;
+	unsigned int b, i = 0;
+	int cpu;
+
+	memset(sum, 0, RBLAT_BUCKETS * sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		rblat_hist *h = &per_cpu_ptr(ringbuf_lat[chan], cpu)->kind[kind];
+
+		for(b = 0; b < RBLAT_BUCKETS; b++)
+			sum[b] += READ_ONCE(h->count[b]);
+		max = MAX(max, READ_ONCE(h->max));
+	}
+	for(b = 0; b < RBLAT_BUCKETS; b++)
+		total += sum[b];
+	if(!total)
+		return;
+
+	seq_printf(m, "chan %u %-8s count %llu", chan,
+		kind == LatDequeue ? "dequeue" : "deliver", total);
+	for(b = 0; b < RBLAT_BUCKETS && i < ARRAY_SIZE(pct); b++) {
+		seen += sum[b];
+		rank = div64_u64(total * pct[i] + 9999, 10000);
+		while(i < ARRAY_SIZE(pct) && seen >= rank) {
+			seq_printf(m, " p%u.%u %llu", pct[i] / 100,
+				(pct[i] % 100) / 10, ringbuf_lat_value(b));
+			if(++i < ARRAY_SIZE(pct))
+				rank = div64_u64(total * pct[i] + 9999, 10000);
+		}
+	}
+	seq_printf(m, " max %llu\n", max);
+}
+
+/*
+ * debugfs ringbuf/latency: percentiles of the channels that saw
+ * messages, in ns, each one the upper bound of its bucket
+ */
+static int ringbuf_latency_show(struct seq_file *m, void *v)
+{
+	unsigned int chan;
+	u64 *sum;
+
+	sum = kmalloc_array(RBLAT_BUCKETS, sizeof(*sum), GFP_KERNEL);
+	if(!sum)
+		return -ENOMEM;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		if(!ringbuf_lat[chan])
+			continue;
+		ringbuf_lat_show_kind(m, chan, LatDequeue, sum);
+		ringbuf_lat_show_kind(m, chan, LatDeliver, sum);
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ringbuf_latency);
+
+/*
+ * debugfs ringbuf/latency_reset: any write clears the histograms. Counts
+ * racing with the reset may survive it.
+ */
+static ssize_t ringbuf_latency_reset(struct file *fp, const char __user *buf,
+					size_t len, loff_t *off)
+{
+	unsigned int chan;
+	int cpu;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		if(!ringbuf_lat[chan])
+			continue;
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(ringbuf_lat[chan], cpu), 0,
+				sizeof(rblat_chan));
+	}
+
+	return len;
+}
+
+static const struct file_operations ringbuf_latency_reset_fops = {
+	.owner		=	THIS_MODULE,
+	.write		=	ringbuf_latency_reset,
+};
+
+static void ringbuf_lat_exit(void)
+{
+	unsigned int chan;
+
+	debugfs_remove_recursive(ringbuf_debugfs);
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++) {
+		free_percpu(ringbuf_lat[chan]);
+		ringbuf_lat[chan] = NULL;
+	}
+}
+
+/*
+ * histograms are best effort too: a channel without one is not measured
+ */
+static void ringbuf_lat_init(void)
+{
+	unsigned int chan;
+
+	for(chan = 0; chan < RINGBUF_MAX_CHANNELS; chan++)
+		ringbuf_lat[chan] = alloc_percpu(rblat_chan);
+
+	ringbuf_debugfs = debugfs_create_dir("ringbuf", NULL);
+	debugfs_create_file("latency", 0444, ringbuf_debugfs, NULL,
+				&ringbuf_latency_fops);
+	debugfs_create_file("latency_reset", 0200, ringbuf_debugfs, NULL,
+				&ringbuf_latency_reset_fops);
+}
+
+static void ringbuf_stage_init(void)
+{
+	rbstage *stage;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(&ringbuf_stage, cpu);
+		spin_lock_init(&stage->lock);
+		INIT_LIST_HEAD(&stage->reqs);
+	}
 }
 
+/*
+ * /proc/ringbuf: the per-CPU counters summed up
+ */
+static int ringbuf_stats_show(struct seq_file *m, void *v)
+{
+	rbpcpu_stats sum = { 0 }, *st;
+	rblock *lock;
+	int cpu, slot;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&ringbuf_pcpu_stats, cpu);
+		sum.msgs_sent += READ_ONCE(st->msgs_sent);
+		sum.bytes_sent += READ_ONCE(st->bytes_sent);
+		sum.msgs_recv += READ_ONCE(st->msgs_recv);
+		sum.bytes_recv += READ_ONCE(st->bytes_recv);
+		sum.ring_full += READ_ONCE(st->ring_full);
+		sum.doorbells += READ_ONCE(st->doorbells);
+		sum.interrupts += READ_ONCE(st->interrupts);
+		sum.tasklet_runs += READ_ONCE(st->tasklet_runs);
+		sum.drain_msgs += READ_ONCE(st->drain_msgs);
+		sum.drain_max = MAX(sum.drain_max, READ_ONCE(st->drain_max));
+		sum.lock_contended += READ_ONCE(st->lock_contended);
+		sum.lock_parked += READ_ONCE(st->lock_parked);
+		sum.lock_wait_ns += READ_ONCE(st->lock_wait_ns);
+		sum.lock_wait_max = MAX(sum.lock_wait_max,
+					READ_ONCE(st->lock_wait_max));
+		sum.lock_skipped += READ_ONCE(st->lock_skipped);
+		sum.comp_msgs += READ_ONCE(st->comp_msgs);
+		sum.comp_saved += READ_ONCE(st->comp_saved);
+		sum.decomp_errors += READ_ONCE(st->decomp_errors);
+		sum.combine_runs += READ_ONCE(st->combine_runs);
+		sum.combine_msgs += READ_ONCE(st->combine_msgs);
+	}
+
+	seq_printf(m, "msgs_sent %llu\n", sum.msgs_sent);
+	seq_printf(m, "bytes_sent %llu\n", sum.bytes_sent);
+	seq_printf(m, "msgs_recv %llu\n", sum.msgs_recv);
+	seq_printf(m, "bytes_recv %llu\n", sum.bytes_recv);
+	seq_printf(m, "ring_full %llu\n", sum.ring_full);
+	seq_printf(m, "doorbells %llu\n", sum.doorbells);
+	seq_printf(m, "interrupts %llu\n", sum.interrupts);
+	seq_printf(m, "tasklet_runs %llu\n", sum.tasklet_runs);
+	seq_printf(m, "drain_avg %llu\n", sum.tasklet_runs ?
+			div64_u64(sum.drain_msgs, sum.tasklet_runs) : 0);
+	seq_printf(m, "drain_max %llu\n", sum.drain_max);
+	seq_printf(m, "write_lock_contended %llu\n", sum.lock_contended);
+	seq_printf(m, "write_lock_parked %llu\n", sum.lock_parked);
+	seq_printf(m, "write_lock_wait_avg_ns %llu\n", sum.lock_contended ?
+			div64_u64(sum.lock_wait_ns, sum.lock_contended) : 0);
+	seq_printf(m, "write_lock_wait_max_ns %llu\n", sum.lock_wait_max);
+	seq_printf(m, "write_lock_skipped %llu\n", sum.lock_skipped);
+	seq_printf(m, "compressed_msgs %llu\n", sum.comp_msgs);
+	seq_printf(m, "compressed_bytes_saved %llu\n", sum.comp_saved);
+	seq_printf(m, "decompress_errors %llu\n", sum.decomp_errors);
+	seq_printf(m, "combine_runs %llu\n", sum.combine_runs);
+	seq_printf(m, "combine_avg %llu\n", sum.combine_runs ?
+			div64_u64(sum.combine_msgs, sum.combine_runs) : 0);
+
+	/* shared by all peers: how fairly the lock went around */
+	lock = ringbuf_dev.write_lock;
+	for (slot = 0; lock && slot < RINGBUF_MAX_PEERS; slot++)
+		if (READ_ONCE(lock->acquired[slot]))
+			seq_printf(m, "write_lock_acquired_slot%d %llu\n", slot,
+				READ_ONCE(lock->acquired[slot]));
 
+	return 0;
+}
 
 static void __exit ringbuf_cleanup(void)
 {
 	pci_unregister_driver(&ringbuf_pci_driver);
+	ringbuf_lat_exit();
 	unregister_chrdev(device_major_nr, "ringbuf");
 }
 
@@ -583,6 +4533,8 @@ static int __init ringbuf_init(void)
 	}
 	device_major_nr = err;
 	printk("RINGBUF: Major device number is: %d\n", device_major_nr);
+	ringbuf_lat_init();
+	ringbuf_stage_init();
 
     	err = pci_register_driver(&ringbuf_pci_driver);
 	if (err < 0) {
@@ -592,6 +4544,7 @@ static int __init ringbuf_init(void)
 	return 0;
 
 error:
+	ringbuf_lat_exit();
 	unregister_chrdev(device_major_nr, "ringbuf");
 	return err;
 }
@@ -0,0 +1,61 @@
+/*
+ * ringbuf.h - in-kernel interface of the ringbuf driver, for modules
+ * that send and receive through the ring without /dev/ringbuf
+ *
+ *	rc = ringbuf_chan_open(chan);
+ *	ringbuf_chan_send(rc, buf, len, 0);
+ *	ringbuf_chan_recv(rc, my_recv, my_data);
+ *	ringbuf_chan_close(rc);
+ *
+ * Buffers are kernel memory. Receive callbacks run in the drain tasklet
+ * with the payload in place, in IVshmem space or decompressed, valid
+ * until they return; they must not sleep nor receive themselves.
+ *
+ * Consumers that drain on their own schedule, like NAPI, are told of
+ * arrivals instead and poll:
+ *
+ *	ringbuf_chan_notify(rc, my_arrival, my_space, my_data);
+ *	n = ringbuf_chan_poll(rc, my_recv, my_data, budget);
+ */
+#ifndef _RINGBUF_H
+#define _RINGBUF_H
+
+#include <linux/types.h>
+#include <linux/uio.h>
+
+/* sends of ringbuf_chan_send*() that fail with -EAGAIN on a full ring */
+#define RINGBUF_NONBLOCK	0x01
+
+struct ringbuf_chan;
+
+/*
+ * @src: IVPosition of the producer
+ * @tstamp: CLOCK_REALTIME of the producer when it sent the message, ns
+ */
+typedef void (*ringbuf_recv_fn)(void *priv, const void *payload,
+				size_t len, u32 src, u64 tstamp);
+
+/*
+ * arrival runs in the drain tasklet, space in the interrupt handler or
+ * the heartbeat work, neither may sleep
+ */
+typedef void (*ringbuf_notify_fn)(void *priv);
+
+struct ringbuf_chan *ringbuf_chan_open(unsigned int chan);
+void ringbuf_chan_close(struct ringbuf_chan *rc);
+ssize_t ringbuf_chan_send(struct ringbuf_chan *rc, const void *buf,
+				size_t len, unsigned int flags);
+ssize_t ringbuf_chan_sendv(struct ringbuf_chan *rc, const struct kvec *iov,
+				unsigned int n, unsigned int flags);
+int ringbuf_chan_send_batch(struct ringbuf_chan *rc, const struct kvec *msgs,
+				unsigned int n, unsigned int flags);
+int ringbuf_chan_recv(struct ringbuf_chan *rc, ringbuf_recv_fn fn,
+				void *priv);
+int ringbuf_chan_notify(struct ringbuf_chan *rc, ringbuf_notify_fn arrival,
+				ringbuf_notify_fn space, void *priv);
+int ringbuf_chan_poll(struct ringbuf_chan *rc, ringbuf_recv_fn fn,
+				void *priv, int budget);
+u32 ringbuf_ivposition(void);
+size_t ringbuf_msg_max(void);
+
+#endif /* _RINGBUF_H */
@@ -0,0 +1,651 @@
+/*
+ * ringbuf_blk.c - block device of one VM used by another over the ring,
+ * on top of the in-kernel interface of ringbuf. The VM that has it
+ * exports a block device or a file, the other one gets /dev/ringblk0:
+ *
+ *	VM a: insmod ringbuf_blk.ko EXPORT=/dev/ram0
+ *	VM b: insmod ringbuf_blk.ko
+ *
+ * Each blk-mq hardware queue sends its requests on channel REQ_CHAN + i,
+ * which the exporting VM consumes, and gets the replies on REPLY_CHAN + i,
+ * right after the request channels unless told otherwise, so every queue
+ * is served on its own MSI-X vector on both sides. A
+ * request is one message, a header and the data it writes gathered from
+ * the bio pages; a reply is the header and the data read.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/workqueue.h>
+
+#include "ringbuf.h"
+
+#define RBBLK_MAX_QUEUES	4
+#define RBBLK_DEPTH		32
+
+/*
+ * longest request, further bounded to a quarter of a lane slice, in
+ * segments of at most a page, which are two pages at worst
+ */
+#define RBBLK_MAX_BYTES		(128 * 1024)
+#define RBBLK_MAX_SEGS		32
+
+static char *EXPORT;
+MODULE_PARM_DESC(EXPORT, "Block device or file to export, none to use the one of the peer.");
+module_param(EXPORT, charp, 0400);
+
+static int REQ_CHAN = 3;
+MODULE_PARM_DESC(REQ_CHAN, "First channel of the requests, consumed by the exporting VM.");
+module_param(REQ_CHAN, int, 0400);
+
+static int REPLY_CHAN = -1;
+MODULE_PARM_DESC(REPLY_CHAN, "First channel of the replies, consumed by the using VM, -1 right after the request channels.");
+module_param(REPLY_CHAN, int, 0400);
+
+static int QUEUES = 1;
+MODULE_PARM_DESC(QUEUES, "Hardware queues, each on its own pair of channels.");
+module_param(QUEUES, int, 0400);
+
+enum {
+	BlkInfo		=	0,	/* capacity of the export, in sectors */
+	BlkRead		=	1,
+	BlkWrite	=	2,
+	BlkFlush	=	3,
+};
+
+#define RBBLK_FUA		0x01
+
+/*
+ * head of the requests and of their replies
+ * @status: errno of the request, in the reply
+ * @tag/cookie: request of the queue the reply completes, the cookie
+ *		tells a late reply from the current user of the tag
+ * @len: bytes to read or write, the data follows in the write request
+ *	 and the read reply
+*/
+struct rbblk_hd {
+	u8	op;
+	u8	flags;
+	u8	status;
+	u8	queue;
+	u32	tag;
+	u32	cookie;
+	u32	len;
+	u64	sector;
+};
+
+/*
+ * a hardware queue and its channels
+ * @lock: orders the completion of a request by its reply or its timeout
+*/
+struct rbblk_queue {
+	unsigned int		id;
+	struct ringbuf_chan	*tx;
+	struct ringbuf_chan	*rx;
+	atomic_t		cookie;
+	spinlock_t		lock;
+};
+
+/*
+ * @file/capacity: what the exporting VM serves, in sectors
+ * @serve_wq: runs the requests of the exporting VM
+ * @info_work: sets the capacity of the using VM once the export told it
+*/
+struct rbblk {
+	unsigned int		queues;
+	struct rbblk_queue	q[RBBLK_MAX_QUEUES];
+
+	struct file		*file;
+	sector_t		capacity;
+	struct workqueue_struct	*serve_wq;
+
+	int			major;
+	struct blk_mq_tag_set	set;
+	struct gendisk		*disk;
+	struct work_struct	info_work;
+};
+
+/* per request of the using VM */
+struct rbblk_cmd {
+	u32	cookie;
+};
+
+/* a request the exporting VM runs from serve_wq */
+struct rbblk_work {
+	struct work_struct	work;
+	struct rbblk_queue	*q;
+	struct rbblk_hd		hd;
+	char			data[];
+};
+
+static struct rbblk rbblk;
+
+/*
+ * exporting side
+ */
+static void rbblk_serve(struct work_struct *work)
+{
+	struct rbblk_work *w = container_of(work, struct rbblk_work, work);
+	struct rbblk_hd hd = w->hd;
+	loff_t pos = hd.sector << SECTOR_SHIFT;
+	struct kvec iov[2];
+	unsigned int n = 1;
+	char *buf = NULL;
+	ssize_t ret = 0;
+
+	switch(hd.op) {
+	case BlkInfo:
+		hd.sector = rbblk.capacity;
+		break;
+
+	case BlkRead:
+		buf = kvmalloc(hd.len, GFP_KERNEL);
+		if(!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = kernel_read(rbblk.file, buf, hd.len, &pos);
+		if(ret >= 0 && ret != hd.len)
+			ret = -EIO;
+		if(ret >= 0) {
+			iov[n].iov_base = buf;
+			iov[n++].iov_len = hd.len;
+		}
+		break;
+
+	case BlkWrite:
+		ret = kernel_write(rbblk.file, w->data, hd.len, &pos);
+		if(ret >= 0 && ret != hd.len)
+			ret = -EIO;
+		if(ret >= 0 && (hd.flags & RBBLK_FUA))
+			ret = vfs_fsync_range(rbblk.file, pos - hd.len,
+						pos - 1, 1);
+		break;
+
+	case BlkFlush:
+		ret = vfs_fsync(rbblk.file, 0);
+		break;
+
+	default:
+		ret = -EOPNOTSUPP;
+	}
+
+	hd.status = ret < 0 ? -ret : 0;
+	if(hd.op != BlkRead || hd.status)
+		hd.len = 0;
+	iov[0].iov_base = &hd;
+	iov[0].iov_len = sizeof(hd);
+	ret = ringbuf_chan_sendv(w->q->tx, iov, n, 0);
+	if(ret < 0)
+		printk(KERN_ERR "ringblk: reply to request %u of queue %u lost: %zd\n",
+			hd.tag, hd.queue, ret);
+
+	kvfree(buf);
+	kfree(w);
+}
+
+/*
+ * fail a request straight from the tasklet, without waiting for room:
+ * if the reply does not fit either, the request times out
+ */
+static void rbblk_refuse(struct rbblk_queue *q, const struct rbblk_hd *req,
+				int err)
+{
+	struct rbblk_hd hd = *req;
+	ssize_t ret;
+
+	hd.status = err;
+	hd.len = 0;
+	ret = ringbuf_chan_send(q->tx, &hd, sizeof(hd), RINGBUF_NONBLOCK);
+	if(ret < 0)
+		printk_ratelimited(KERN_ERR "ringblk: reply to request %u of queue %u lost: %zd\n",
+			hd.tag, hd.queue, ret);
+}
+
+/* receive callback of the requests, from the tasklet of ringbuf */
+static void rbblk_request(void *priv, const void *payload, size_t len,
+				u32 src, u64 tstamp)
+{
+	struct rbblk_queue *q = priv;
+	const struct rbblk_hd *hd = payload;
+	size_t data = 0;
+	struct rbblk_work *w;
+
+	if(len < sizeof(*hd))
+		return;
+	if(hd->op == BlkWrite)
+		data = hd->len;
+	if(len != sizeof(*hd) + data || hd->len > ringbuf_msg_max()) {
+		rbblk_refuse(q, hd, EINVAL);
+		return;
+	}
+
+	/* the data of a write has to leave the ring before the tasklet does */
+	w = kmalloc(sizeof(*w) + data, GFP_ATOMIC | __GFP_NOWARN);
+	if(!w) {
+		printk_ratelimited(KERN_ERR "ringblk: no memory for request %u of queue %u\n",
+			hd->tag, hd->queue);
+		rbblk_refuse(q, hd, ENOMEM);
+		return;
+	}
+	INIT_WORK(&w->work, rbblk_serve);
+	w->q = q;
+	w->hd = *hd;
+	memcpy(w->data, payload + sizeof(*hd), data);
+
+	queue_work(rbblk.serve_wq, &w->work);
+}
+
+static int rbblk_export_init(void)
+{
+	struct rbblk_queue *q;
+	unsigned int i;
+	int ret;
+
+	rbblk.file = filp_open(EXPORT, O_RDWR | O_LARGEFILE, 0);
+	if(IS_ERR(rbblk.file))
+		return PTR_ERR(rbblk.file);
+	rbblk.capacity = i_size_read(rbblk.file->f_mapping->host)
+				>> SECTOR_SHIFT;
+
+	rbblk.serve_wq = alloc_workqueue("ringblk", WQ_UNBOUND | WQ_MEM_RECLAIM,
+					0);
+	if(!rbblk.serve_wq) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	for(i = 0; i < rbblk.queues; i++) {
+		q = &rbblk.q[i];
+		ret = ringbuf_chan_recv(q->rx, rbblk_request, q);
+		if(ret)
+			goto error;
+	}
+
+	printk(KERN_INFO "ringblk: exporting %s, %llu sectors, %u queues\n",
+		EXPORT, (unsigned long long)rbblk.capacity, rbblk.queues);
+
+	return 0;
+
+error:
+	filp_close(rbblk.file, NULL);
+	return ret;
+}
+
+/*
+ * using side
+ */
+static void rbblk_info(struct work_struct *work)
+{
+	set_capacity_and_notify(rbblk.disk, rbblk.capacity);
+	printk(KERN_INFO "ringblk: %s has %llu sectors\n",
+		rbblk.disk->disk_name, (unsigned long long)rbblk.capacity);
+}
+
+/* receive callback of the replies, from the tasklet of ringbuf */
+static void rbblk_reply(void *priv, const void *payload, size_t len,
+				u32 src, u64 tstamp)
+{
+	struct rbblk_queue *q = priv;
+	const struct rbblk_hd *hd = payload;
+	struct rbblk_cmd *cmd;
+	struct req_iterator iter;
+	struct request *rq;
+	struct bio_vec bv;
+	size_t off = 0;
+	bool ours;
+
+	if(len < sizeof(*hd) || len != sizeof(*hd) + hd->len)
+		return;
+
+	if(hd->op == BlkInfo) {
+		if(hd->status) {
+			printk(KERN_ERR "ringblk: the export did not tell its size: %d\n",
+				-hd->status);
+			return;
+		}
+		rbblk.capacity = hd->sector;
+		schedule_work(&rbblk.info_work);
+		return;
+	}
+
+	if(hd->tag >= RBBLK_DEPTH)
+		return;
+	rq = blk_mq_tag_to_rq(rbblk.set.tags[q->id], hd->tag);
+	if(!rq)
+		return;
+
+	spin_lock(&q->lock);
+	cmd = blk_mq_rq_to_pdu(rq);
+	ours = blk_mq_request_started(rq) && cmd->cookie == hd->cookie;
+	if(ours)
+		cmd->cookie = 0;
+	spin_unlock(&q->lock);
+	if(!ours)
+		return;
+
+	if(hd->status) {
+		blk_mq_end_request(rq, errno_to_blk_status(-hd->status));
+		return;
+	}
+	if(hd->op == BlkRead) {
+		if(hd->len != blk_rq_bytes(rq)) {
+			blk_mq_end_request(rq, BLK_STS_IOERR);
+			return;
+		}
+		payload += sizeof(*hd);
+		rq_for_each_segment(bv, rq, iter) {
+			memcpy_to_bvec(&bv, payload + off);
+			off += bv.bv_len;
+		}
+	}
+
+	blk_mq_end_request(rq, BLK_STS_OK);
+}
+
+static blk_status_t rbblk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				const struct blk_mq_queue_data *bd)
+{
+	struct rbblk_queue *q = hctx->driver_data;
+	struct request *rq = bd->rq;
+	struct rbblk_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct kvec iov[2 * RBBLK_MAX_SEGS + 1];
+	struct req_iterator iter;
+	struct rbblk_hd hd = {};
+	struct bio_vec bv;
+	unsigned int n = 1;
+	ssize_t ret;
+
+	switch(req_op(rq)) {
+	case REQ_OP_READ:
+		hd.op = BlkRead;
+		break;
+	case REQ_OP_WRITE:
+		hd.op = BlkWrite;
+		break;
+	case REQ_OP_FLUSH:
+		hd.op = BlkFlush;
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+	if(rq->cmd_flags & REQ_FUA)
+		hd.flags |= RBBLK_FUA;
+	hd.queue = q->id;
+	hd.tag = rq->tag;
+	hd.sector = blk_rq_pos(rq);
+	hd.len = hd.op == BlkFlush ? 0 : blk_rq_bytes(rq);
+
+	/* 0 is no request */
+	hd.cookie = atomic_inc_return(&q->cookie) ?: atomic_inc_return(&q->cookie);
+	cmd->cookie = hd.cookie;
+	blk_mq_start_request(rq);
+
+	iov[0].iov_base = &hd;
+	iov[0].iov_len = sizeof(hd);
+	/* x86_64 has no highmem, the mappings do not nest out of slots */
+	if(hd.op == BlkWrite) {
+		rq_for_each_segment(bv, rq, iter) {
+			iov[n].iov_base = bvec_kmap_local(&bv);
+			iov[n++].iov_len = bv.bv_len;
+		}
+	}
+
+	ret = ringbuf_chan_sendv(q->tx, iov, n, RINGBUF_NONBLOCK);
+	while(n-- > 1)
+		kunmap_local(iov[n].iov_base);
+
+	/* rerun by the space callback, or by blk-mq after a while */
+	if(ret == -EAGAIN)
+		return BLK_STS_RESOURCE;
+	if(ret < 0)
+		return BLK_STS_IOERR;
+
+	return BLK_STS_OK;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+static enum blk_eh_timer_return rbblk_timeout(struct request *rq)
+#else
+static enum blk_eh_timer_return rbblk_timeout(struct request *rq,
+						bool reserved)
+#endif
+{
+	struct rbblk_queue *q = rq->mq_hctx->driver_data;
+	struct rbblk_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	bool ours;
+
+	spin_lock_bh(&q->lock);
+	ours = cmd->cookie != 0;
+	cmd->cookie = 0;
+	spin_unlock_bh(&q->lock);
+
+	/* the reply came in first and completes it */
+	if(!ours)
+		return BLK_EH_DONE;
+
+	printk(KERN_ERR "ringblk: request %u of queue %u timed out\n",
+		rq->tag, q->id);
+	blk_mq_end_request(rq, BLK_STS_TIMEOUT);
+
+	return BLK_EH_DONE;
+}
+
+static int rbblk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+				unsigned int idx)
+{
+	hctx->driver_data = &rbblk.q[idx];
+	return 0;
+}
+
+static const struct blk_mq_ops rbblk_mq_ops = {
+	.queue_rq	= rbblk_queue_rq,
+	.timeout	= rbblk_timeout,
+	.init_hctx	= rbblk_init_hctx,
+};
+
+static const struct block_device_operations rbblk_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static void rbblk_space(void *priv)
+{
+	if(rbblk.disk)
+		blk_mq_run_hw_queues(rbblk.disk->queue, true);
+}
+
+static int rbblk_disk_init(void)
+{
+	struct rbblk_hd hd = { .op = BlkInfo };
+	unsigned int max_bytes, i;
+	struct gendisk *disk;
+	int ret;
+
+	max_bytes = min_t(size_t, RBBLK_MAX_BYTES,
+			(ringbuf_msg_max() / 4) & ~(SECTOR_SIZE - 1));
+	if(max_bytes < PAGE_SIZE)
+		return -ENODEV;
+
+	rbblk.major = register_blkdev(0, "ringblk");
+	if(rbblk.major < 0)
+		return rbblk.major;
+
+	rbblk.set.ops = &rbblk_mq_ops;
+	rbblk.set.nr_hw_queues = rbblk.queues;
+	rbblk.set.queue_depth = RBBLK_DEPTH;
+	rbblk.set.numa_node = NUMA_NO_NODE;
+	rbblk.set.cmd_size = sizeof(struct rbblk_cmd);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,14,0)
+	rbblk.set.flags = BLK_MQ_F_SHOULD_MERGE;
+#endif
+	ret = blk_mq_alloc_tag_set(&rbblk.set);
+	if(ret)
+		goto unregister;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,9,0)
+	{
+		struct queue_limits lim = {
+			.max_hw_sectors		= max_bytes >> SECTOR_SHIFT,
+			.max_segments		= RBBLK_MAX_SEGS,
+			.max_segment_size	= PAGE_SIZE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+			.features		= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA,
+#endif
+		};
+
+		disk = blk_mq_alloc_disk(&rbblk.set, &lim, &rbblk);
+	}
+#else
+	disk = blk_mq_alloc_disk(&rbblk.set, &rbblk);
+#endif
+	if(IS_ERR(disk)) {
+		ret = PTR_ERR(disk);
+		goto free_set;
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,9,0)
+	blk_queue_max_hw_sectors(disk->queue, max_bytes >> SECTOR_SHIFT);
+	blk_queue_max_segments(disk->queue, RBBLK_MAX_SEGS);
+	blk_queue_max_segment_size(disk->queue, PAGE_SIZE);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
+	blk_queue_write_cache(disk->queue, true, true);
+#endif
+
+	disk->major = rbblk.major;
+	disk->first_minor = 0;
+	disk->minors = 1;
+	disk->fops = &rbblk_fops;
+	disk->private_data = &rbblk;
+	snprintf(disk->disk_name, sizeof(disk->disk_name), "ringblk0");
+	set_capacity(disk, 0);
+
+	rbblk.disk = disk;
+	ret = add_disk(disk);
+	if(ret)
+		goto put_disk;
+
+	for(i = 0; i < rbblk.queues; i++) {
+		ret = ringbuf_chan_recv(rbblk.q[i].rx, rbblk_reply, &rbblk.q[i]);
+		if(!ret)
+			ret = ringbuf_chan_notify(rbblk.q[i].tx, NULL,
+						rbblk_space, &rbblk.q[i]);
+		if(ret)
+			goto del_disk;
+	}
+
+	/* waits in the ring for the export if it is not there yet */
+	ret = ringbuf_chan_send(rbblk.q[0].tx, &hd, sizeof(hd), 0);
+	if(ret < 0)
+		goto del_disk;
+
+	printk(KERN_INFO "ringblk: %s, %u queues, requests up to %u bytes\n",
+		disk->disk_name, rbblk.queues, max_bytes);
+
+	return 0;
+
+del_disk:
+	del_gendisk(disk);
+put_disk:
+	rbblk.disk = NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	put_disk(disk);
+#else
+	blk_cleanup_disk(disk);
+#endif
+free_set:
+	blk_mq_free_tag_set(&rbblk.set);
+unregister:
+	unregister_blkdev(rbblk.major, "ringblk");
+	return ret;
+}
+
+/* no callback runs once the channels are closed */
+static void rbblk_close_chans(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < rbblk.queues; i++)
+		ringbuf_chan_close(rbblk.q[i].rx);
+
+	/* the requests being served still reply */
+	if(rbblk.serve_wq)
+		destroy_workqueue(rbblk.serve_wq);
+	rbblk.serve_wq = NULL;
+
+	for(i = 0; i < rbblk.queues; i++)
+		ringbuf_chan_close(rbblk.q[i].tx);
+}
+
+int __init rbblk_init(void)
+{
+	struct rbblk_queue *q;
+	unsigned int i;
+	int ret;
+
+	if(REPLY_CHAN < 0)
+		REPLY_CHAN = REQ_CHAN + QUEUES;
+	if(QUEUES < 1 || QUEUES > RBBLK_MAX_QUEUES || REQ_CHAN < 0 ||
+	   (REQ_CHAN < REPLY_CHAN + QUEUES &&
+	    REPLY_CHAN < REQ_CHAN + QUEUES)) {
+		printk(KERN_ERR "ringblk: %d queues from request channel %d and reply channel %d do not fit\n",
+			QUEUES, REQ_CHAN, REPLY_CHAN);
+		return -EINVAL;
+	}
+
+	INIT_WORK(&rbblk.info_work, rbblk_info);
+	for(i = 0; i < QUEUES; i++) {
+		q = &rbblk.q[i];
+		q->id = i;
+		spin_lock_init(&q->lock);
+		rbblk.queues++;
+
+		/* the exporting VM receives the requests and sends replies */
+		q->rx = ringbuf_chan_open((EXPORT ? REQ_CHAN : REPLY_CHAN) + i);
+		q->tx = ringbuf_chan_open((EXPORT ? REPLY_CHAN : REQ_CHAN) + i);
+		if(IS_ERR(q->rx) || IS_ERR(q->tx)) {
+			ret = IS_ERR(q->rx) ? PTR_ERR(q->rx) : PTR_ERR(q->tx);
+			goto error;
+		}
+	}
+
+	ret = EXPORT ? rbblk_export_init() : rbblk_disk_init();
+	if(ret)
+		goto error;
+
+	return 0;
+
+error:
+	rbblk_close_chans();
+	return ret;
+}
+
+void __exit rbblk_exit(void)
+{
+	if(EXPORT) {
+		rbblk_close_chans();
+		filp_close(rbblk.file, NULL);
+		return;
+	}
+
+	del_gendisk(rbblk.disk);
+	rbblk_close_chans();
+	cancel_work_sync(&rbblk.info_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	put_disk(rbblk.disk);
+#else
+	blk_cleanup_disk(rbblk.disk);
+#endif
+	blk_mq_free_tag_set(&rbblk.set);
+	unregister_blkdev(rbblk.major, "ringblk");
+}
+
+module_init(rbblk_init);
+module_exit(rbblk_exit);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,249 @@
+/*
+ * copy engines of the payloads to and from BAR2, picked at load time
+ * from the CPU features and then per message from its length:
+ *
+ *	CopyMemcpy	the kernel memcpy
+ *	CopyErms	rep movsb, fast on CPUs with ERMS for any length
+ *	CopyAvx2	32 byte loads and stores, under kernel_fpu_begin
+ *	CopyAvx512	64 byte loads and stores, under kernel_fpu_begin
+ *	CopyNt		movnti streaming stores, which leave the producer's
+ *			cache alone when only the peer VM reads the data;
+ *			BAR2 is mapped write-back for that, on an uncached
+ *			mapping every store bypasses the cache anyway
+ *
+ * Saving the FPU state costs more than short copies take, so the vector
+ * engines only take over from vec_min on. Streaming stores only go
+ * towards BAR2, from nt_min on. test/bench_copy.c measures where the
+ * crossovers are on a given CPU.
+ */
+#ifndef _RINGBUF_COPY_H
+#define _RINGBUF_COPY_H
+
+#include <linux/types.h>
+#include <linux/string.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+enum {
+	CopyMemcpy	=	0,
+	CopyErms	=	1,
+	CopyAvx2	=	2,
+	CopyAvx512	=	3,
+	CopyNt		=	4,
+	CopyEngines,
+};
+
+static const char * const rbcopy_names[CopyEngines] = {
+	"memcpy", "erms", "avx2", "avx512", "nt",
+};
+
+/*
+ * engines picked for a device
+ * @small: engine of the copies shorter than vec_min
+ * @large: engine of the copies from vec_min on
+ * @vec_min: length from which large is used
+ * @nt_min: length from which copies to BAR2 use CopyNt, 0 never
+*/
+typedef struct ringbuf_copy {
+	unsigned int	small;
+	unsigned int	large;
+	size_t		vec_min;
+	size_t		nt_min;
+} rbcopy;
+
+#ifdef CONFIG_X86_64
+/*
+ * the kernel clears the AVX flags when XSAVE does not enable their
+ * state, so the feature bits are enough
+ */
+static inline bool rbcopy_supported(unsigned int engine)
+{
+	switch(engine) {
+	case CopyMemcpy:
+	case CopyNt:
+		return true;
+	case CopyErms:
+		return boot_cpu_has(X86_FEATURE_ERMS);
+	case CopyAvx2:
+		return boot_cpu_has(X86_FEATURE_AVX2);
+	case CopyAvx512:
+		return boot_cpu_has(X86_FEATURE_AVX512F);
+	}
+
+	return false;
+}
+
+static inline void rbcopy_erms(void *dst, const void *src, size_t len)
+{
+	asm volatile("rep movsb"
+		: "+D" (dst), "+S" (src), "+c" (len)
+		: : "memory");
+}
+
+static inline void rbcopy_avx2(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+
+	kernel_fpu_begin();
+	for(; len >= 128; len -= 128, d += 128, s += 128)
+		asm volatile(
+			"vmovdqu   (%1), %%ymm0\n\t"
+			"vmovdqu 32(%1), %%ymm1\n\t"
+			"vmovdqu 64(%1), %%ymm2\n\t"
+			"vmovdqu 96(%1), %%ymm3\n\t"
+			"vmovdqu %%ymm0,   (%0)\n\t"
+			"vmovdqu %%ymm1, 32(%0)\n\t"
+			"vmovdqu %%ymm2, 64(%0)\n\t"
+			"vmovdqu %%ymm3, 96(%0)\n\t"
+			: : "r" (d), "r" (s) : "memory");
+	kernel_fpu_end();
+
+	memcpy(d, s, len);
+}
+
+static inline void rbcopy_avx512(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+
+	kernel_fpu_begin();
+	for(; len >= 256; len -= 256, d += 256, s += 256)
+		asm volatile(
+			"vmovdqu64    (%1), %%zmm0\n\t"
+			"vmovdqu64  64(%1), %%zmm1\n\t"
+			"vmovdqu64 128(%1), %%zmm2\n\t"
+			"vmovdqu64 192(%1), %%zmm3\n\t"
+			"vmovdqu64 %%zmm0,    (%0)\n\t"
+			"vmovdqu64 %%zmm1,  64(%0)\n\t"
+			"vmovdqu64 %%zmm2, 128(%0)\n\t"
+			"vmovdqu64 %%zmm3, 192(%0)\n\t"
+			: : "r" (d), "r" (s) : "memory");
+	kernel_fpu_end();
+
+	memcpy(d, s, len);
+}
+
+/*
+ * streaming stores need no FPU state. The sfence orders them before
+ * the header that publishes the message.
+ */
+static inline void rbcopy_nt(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head = -(unsigned long)d & 7;
+
+	if(head > len)
+		head = len;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	for(; len >= 32; len -= 32, d += 32, s += 32)
+		asm volatile(
+			"movq    (%1), %%r8\n\t"
+			"movq   8(%1), %%r9\n\t"
+			"movq  16(%1), %%r10\n\t"
+			"movq  24(%1), %%r11\n\t"
+			"movnti %%r8,    (%0)\n\t"
+			"movnti %%r9,   8(%0)\n\t"
+			"movnti %%r10, 16(%0)\n\t"
+			"movnti %%r11, 24(%0)\n\t"
+			: : "r" (d), "r" (s)
+			: "memory", "r8", "r9", "r10", "r11");
+	asm volatile("sfence" : : : "memory");
+
+	memcpy(d, s, len);
+}
+
+static inline void rbcopy_run(unsigned int engine, void *dst,
+				const void *src, size_t len)
+{
+	switch(engine) {
+	case CopyErms:
+		rbcopy_erms(dst, src, len);
+		return;
+	case CopyAvx2:
+	case CopyAvx512:
+		/* no FPU from an interrupt that preempted its user */
+		if(!irq_fpu_usable())
+			break;
+		if(engine == CopyAvx2)
+			rbcopy_avx2(dst, src, len);
+		else
+			rbcopy_avx512(dst, src, len);
+		return;
+	case CopyNt:
+		rbcopy_nt(dst, src, len);
+		return;
+	}
+
+	memcpy(dst, src, len);
+}
+#else
+static inline bool rbcopy_supported(unsigned int engine)
+{
+	return engine == CopyMemcpy;
+}
+
+static inline void rbcopy_run(unsigned int engine, void *dst,
+				const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+#endif
+
+/*
+ * pick the engines of this CPU, or force one if engine is not -1. An
+ * engine the CPU lacks falls back to memcpy.
+ */
+static inline void rbcopy_init(rbcopy *c, int engine, size_t vec_min,
+				size_t nt_min)
+{
+	c->vec_min = vec_min;
+	c->nt_min = nt_min;
+
+	if(engine >= 0 && engine < CopyEngines) {
+		c->small = c->large = rbcopy_supported(engine) ?
+						engine : CopyMemcpy;
+		if(c->small != CopyNt)
+			c->nt_min = 0;
+		return;
+	}
+
+	c->small = rbcopy_supported(CopyErms) ? CopyErms : CopyMemcpy;
+	if(rbcopy_supported(CopyAvx512))
+		c->large = CopyAvx512;
+	else if(rbcopy_supported(CopyAvx2))
+		c->large = CopyAvx2;
+	else
+		c->large = c->small;
+	if(!rbcopy_supported(CopyNt))
+		c->nt_min = 0;
+}
+
+/* copy a payload into BAR2 */
+static inline void rbcopy_to(const rbcopy *c, void *dst, const void *src,
+				size_t len)
+{
+	if(c->nt_min && len >= c->nt_min)
+		rbcopy_run(CopyNt, dst, src, len);
+	else
+		rbcopy_run(len >= c->vec_min ? c->large : c->small,
+				dst, src, len);
+}
+
+/* copy a payload out of BAR2, streaming stores would only cost us here */
+static inline void rbcopy_from(const rbcopy *c, void *dst, const void *src,
+				size_t len)
+{
+	unsigned int engine = len >= c->vec_min ? c->large : c->small;
+
+	rbcopy_run(engine == CopyNt ? CopyMemcpy : engine, dst, src, len);
+}
+
+#endif /* _RINGBUF_COPY_H */
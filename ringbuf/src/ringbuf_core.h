@@ -0,0 +1,436 @@
+/*
+ * ringbuf_core.h - the ring protocol, shared by the driver and the
+ * userspace harness in ../test
+ *
+ * Layout of a channel ring, publication of its indices and the lane
+ * window that allocates payload space. Nothing in here knows about
+ * PCI, peers or locks: publishing needs the producers' lock held,
+ * consuming is for the one consumer of the ring.
+ */
+#ifndef _RINGBUF_CORE_H
+#define _RINGBUF_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/compiler.h>
+#include <linux/cache.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <asm/barrier.h>
+
+/*
+ * BAR2 is shared with other VMs, keep the mandatory barriers: an index
+ * is stored after what it covers, written (producer) or read (consumer)
+ */
+#define rb_publish_store(p, v)	do { wmb(); WRITE_ONCE(*(p), (v)); } while (0)
+#define rb_retire_store(p, v)	do { mb(); WRITE_ONCE(*(p), (v)); } while (0)
+#define rb_load_acquire(p)	({ typeof(*(p)) __v = READ_ONCE(*(p)); rmb(); __v; })
+#define rb_fetch_add(p, v)	atomic_fetch_add((v), (atomic_t *)(p))
+#define rb_cmpxchg(p, o, n)	cmpxchg((p), (o), (n))
+#define rb_set_bit_mb(nr, p)	((void)test_and_set_bit((nr), (p)))
+#define rb_test_and_clear_bit(nr, p)	test_and_clear_bit((nr), (p))
+#define rb_store_mb(p, v)	do { mb(); WRITE_ONCE(*(p), (v)); mb(); } while (0)
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ____cacheline_aligned	__attribute__((__aligned__(64)))
+
+#define rb_publish_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define rb_retire_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define rb_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define rb_fetch_add(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define rb_cmpxchg(p, o, n)	({ typeof(*(p)) __o = (o); \
+	__atomic_compare_exchange_n((p), &__o, (n), 0, __ATOMIC_SEQ_CST, \
+				__ATOMIC_SEQ_CST); __o; })
+#define rb_set_bit_mb(nr, p)	((void)__atomic_fetch_or((p), 1UL << (nr), \
+				__ATOMIC_SEQ_CST))
+#define rb_test_and_clear_bit(nr, p)	(__atomic_fetch_and((p), ~(1UL << (nr)), \
+				__ATOMIC_SEQ_CST) & (1UL << (nr)))
+#define rb_store_mb(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+#define RINGBUF_SLOTS		256
+#define RINGBUF_MAX_CHANNELS	8
+#define RINGBUF_MAX_PEERS	16
+#define RINGBUF_WINDOW		64
+#define RBLOCK_NONE		0xffffffff
+#define RBLOCK_STEP		2
+#define RBSLOT_INLINE		36
+#define RBMSG_INLINE		0x10
+
+/*
+ * message sent via ring buffer, as header of the payloads
+ * @src_qid: IVPosition of the producer
+ * @src_gen: generation of the producer's peer slot when it was sent
+ * @seq: sequence number in the lane (producer, channel), from 1
+ * @flags: RBMSG_RPC_REQ/REP, RBMSG_LZ4 or RBMSG_ZSTD if the payload is
+ *	   compressed, RBMSG_INLINE if it is in the ring slot, and the
+ *	   reply channel of a request
+ * @corr_id: correlation ID matching an RPC reply with its request
+ * @tstamp: CLOCK_REALTIME of the producer when it first sent the message,
+ *	    in ns. VMs on one host share it closely enough for latencies.
+ * @payload_len: bytes in the lane slice, compressed or not
+ * @raw_len: length of the message once decompressed
+*/
+typedef struct ringbuf_msg_hd {
+	unsigned int src_qid;
+	unsigned int src_gen;
+	unsigned int seq;
+	unsigned int flags;
+	unsigned int corr_id;
+	u64 tstamp;
+
+	unsigned int payload_off;
+	ssize_t payload_len;
+	unsigned int raw_len;
+} rbmsg_hd;
+
+/*
+ * a message in the ring, packed into one cache line so that a small
+ * one costs the consumer a single transfer: payloads of up to
+ * RBSLOT_INLINE bytes are carried in the slot, larger ones are
+ * referred to in the lane slice of the producer
+ * @len: payload_len, inline or in the lane slice
+ * @off/raw_len: payload_off and raw_len of a payload in the lane slice
+ * @data: an RBMSG_INLINE payload
+*/
+typedef struct ringbuf_slot {
+	u16 src_qid;
+	u16 flags;
+	u32 src_gen;
+	u32 seq;
+	u32 corr_id;
+	u64 tstamp;
+	u32 len;
+	union {
+		struct {
+			u32 off;
+			u32 raw_len;
+		} ref;
+		unsigned char data[RBSLOT_INLINE];
+	};
+} ____cacheline_aligned rbslot;
+
+/*
+ * ring of message headers of a channel, in IVshmem space. Indices are
+ * free running and only ever published with a barrier after the slot,
+ * so the ring can be picked up again by any peer at any time.
+ * @generation: superblock generation the ring was formatted under
+ * @epoch: bumped every time the ring is formatted, in-flight messages
+ *	   are lost then and producers retransmit what was not acked
+ * @size: number of slots
+ * @policy: PolicyDrop or PolicyBlock when the ring is full
+ * @head: next slot to fill, moved by producers under write_lock
+ * @tail: next slot to consume, moved by the consumer only
+ * @ack: cumulative ack of each producer slot, i.e. the last sequence
+ *	 number consumed in its lane, written by the consumer only
+ * @waiters: bitmask of the producer slots blocked on a full ring
+*/
+typedef struct ringbuf_ring {
+	unsigned int generation;
+	unsigned int epoch;
+	unsigned int size;
+	unsigned int policy;
+
+	unsigned int head ____cacheline_aligned;
+	unsigned int tail ____cacheline_aligned;
+	unsigned int ack[RINGBUF_MAX_PEERS];
+	unsigned long waiters ____cacheline_aligned;
+
+	rbslot slots[RINGBUF_SLOTS];
+} rbring;
+
+/*
+ * messages of a lane sent but not acked yet, kept by the producer to
+ * retransmit them and to know which part of the lane slice is in use.
+ * Entries between @first and @last, both free running. An inline
+ * message takes no room in the slice, its payload is kept in @data.
+*/
+typedef struct ringbuf_window {
+	unsigned int seq[RINGBUF_WINDOW];
+	unsigned int off[RINGBUF_WINDOW];
+	unsigned int len[RINGBUF_WINDOW];
+	unsigned int raw_len[RINGBUF_WINDOW];
+	unsigned int flags[RINGBUF_WINDOW];
+	unsigned int corr_id[RINGBUF_WINDOW];
+	u64 tstamp[RINGBUF_WINDOW];
+	unsigned char data[RINGBUF_WINDOW][RBSLOT_INLINE];
+	unsigned int first;
+	unsigned int last;
+	unsigned int epoch;
+} rbwindow;
+
+/*
+ * ticket lock of the producers of all VMs, served in the order the
+ * tickets were taken so that no VM can starve the others. The layout
+ * is ours, unlike a spinlock_t whose size and meaning depend on the
+ * kernel config of each guest.
+ * Tickets go by RBLOCK_STEP, so that the odd RBLOCK_NONE is never one.
+ * @next: next ticket to hand out
+ * @serving: ticket holding the lock
+ * @sleepers: bitmask of the peer slots parked until the ticket before
+ *	      theirs rings them
+ * @ticket: ticket each peer slot waits with or holds, RBLOCK_NONE
+ * @acquired: times each peer slot took the lock, written by the holder
+*/
+typedef struct ringbuf_lock {
+	unsigned int next ____cacheline_aligned;
+	unsigned int serving ____cacheline_aligned;
+	unsigned long sleepers;
+	unsigned int ticket[RINGBUF_MAX_PEERS];
+	u64 acquired[RINGBUF_MAX_PEERS];
+} rblock;
+
+static inline void rblock_init(rblock *lock)
+{
+	unsigned int i;
+
+	lock->next = 0;
+	lock->serving = 0;
+	lock->sleepers = 0;
+	for(i = 0; i < RINGBUF_MAX_PEERS; i++) {
+		lock->ticket[i] = RBLOCK_NONE;
+		lock->acquired[i] = 0;
+	}
+}
+
+/* queue up peer slot @slot, returns its ticket */
+static inline unsigned int rblock_ticket(rblock *lock, unsigned int slot)
+{
+	unsigned int t = rb_fetch_add(&lock->next, RBLOCK_STEP);
+
+	WRITE_ONCE(lock->ticket[slot], t);
+	return t;
+}
+
+static inline int rblock_granted(rblock *lock, unsigned int t)
+{
+	return rb_load_acquire(&lock->serving) == t;
+}
+
+/*
+ * ask to be rung when our turn comes, then look again: returns nonzero
+ * if the lock was handed over meanwhile and there is no need to sleep
+ */
+static inline int rblock_park(rblock *lock, unsigned int slot, unsigned int t)
+{
+	rb_set_bit_mb(slot, &lock->sleepers);
+	return rblock_granted(lock, t);
+}
+
+/* peer slot waiting with ticket @t, or -1 if it has not shown up yet */
+static inline int rblock_waiter(rblock *lock, unsigned int t)
+{
+	unsigned int i;
+
+	for(i = 0; i < RINGBUF_MAX_PEERS; i++)
+		if(READ_ONCE(lock->ticket[i]) == t)
+			return i;
+
+	return -1;
+}
+
+/*
+ * hand the lock over to the next ticket, which is returned. The caller
+ * rings its holder if rblock_unpark() says it sleeps.
+ */
+static inline unsigned int rblock_release(rblock *lock, unsigned int slot)
+{
+	unsigned int t = lock->serving + RBLOCK_STEP;
+
+	lock->acquired[slot]++;
+	WRITE_ONCE(lock->ticket[slot], RBLOCK_NONE);
+	rb_store_mb(&lock->serving, t);
+
+	return t;
+}
+
+static inline int rblock_unpark(rblock *lock, unsigned int slot)
+{
+	return rb_test_and_clear_bit(slot, &lock->sleepers) != 0;
+}
+
+/*
+ * skip ticket @t, held by peer slot @slot which will never release it,
+ * or by nobody if @slot is -1. Only one of the peers that find it dead
+ * moves the lock on.
+ */
+static inline int rblock_skip(rblock *lock, int slot, unsigned int t)
+{
+	if(slot >= 0 && rb_cmpxchg(&lock->ticket[slot], t, RBLOCK_NONE) != t)
+		return 0;
+
+	return rb_cmpxchg(&lock->serving, t, t + RBLOCK_STEP) == t;
+}
+
+static inline unsigned int rbring_used(rbring *ring)
+{
+	return READ_ONCE(ring->head) - READ_ONCE(ring->tail);
+}
+
+/*
+ * append a message, with the producers' lock held: its header, and
+ * @data too if it is RBMSG_INLINE. -ENOBUFS if full.
+ */
+static inline int rbring_publish(rbring *ring, const rbmsg_hd *hd,
+				const void *data)
+{
+	unsigned int head = ring->head;
+	rbslot *slot;
+
+	if(head - READ_ONCE(ring->tail) >= RINGBUF_SLOTS)
+		return -ENOBUFS;
+
+	slot = &ring->slots[head & (RINGBUF_SLOTS - 1)];
+	slot->src_qid = hd->src_qid;
+	slot->flags = hd->flags;
+	slot->src_gen = hd->src_gen;
+	slot->seq = hd->seq;
+	slot->corr_id = hd->corr_id;
+	slot->tstamp = hd->tstamp;
+	slot->len = hd->payload_len;
+	if(hd->flags & RBMSG_INLINE) {
+		memcpy(slot->data, data, hd->payload_len);
+	} else {
+		slot->ref.off = hd->payload_off;
+		slot->ref.raw_len = hd->raw_len;
+	}
+	rb_publish_store(&ring->head, head + 1);
+
+	return 0;
+}
+
+/*
+ * copy out the header of the oldest message, -ENODATA if the ring is
+ * empty. The payload of an inline one stays at rbring_inline().
+ */
+static inline int rbring_peek(rbring *ring, rbmsg_hd *hd)
+{
+	unsigned int tail = ring->tail;
+	rbslot *slot;
+
+	if(rb_load_acquire(&ring->head) == tail)
+		return -ENODATA;
+
+	slot = &ring->slots[tail & (RINGBUF_SLOTS - 1)];
+	hd->src_qid = slot->src_qid;
+	hd->flags = slot->flags;
+	hd->src_gen = slot->src_gen;
+	hd->seq = slot->seq;
+	hd->corr_id = slot->corr_id;
+	hd->tstamp = slot->tstamp;
+	hd->payload_len = slot->len;
+	if(hd->flags & RBMSG_INLINE) {
+		hd->payload_off = 0;
+		hd->raw_len = slot->len;
+	} else {
+		hd->payload_off = slot->ref.off;
+		hd->raw_len = slot->ref.raw_len;
+	}
+
+	return 0;
+}
+
+/* payload of the oldest message, if it was peeked as RBMSG_INLINE */
+static inline const unsigned char *rbring_inline(rbring *ring)
+{
+	return ring->slots[ring->tail & (RINGBUF_SLOTS - 1)].data;
+}
+
+/* drop the oldest header without acking it */
+static inline void rbring_skip(rbring *ring)
+{
+	rb_retire_store(&ring->tail, ring->tail + 1);
+}
+
+/*
+ * retire the oldest header once its payload was read, acking its
+ * sequence number in the lane of producer slot @peer
+ */
+static inline void rbring_consume(rbring *ring, unsigned int peer,
+				unsigned int seq)
+{
+	rb_retire_store(&ring->ack[peer], seq);
+	WRITE_ONCE(ring->tail, ring->tail + 1);
+}
+
+/* forget the messages the consumer acked */
+static inline void rbwindow_release(rbwindow *win, unsigned int ack)
+{
+	while(win->first != win->last &&
+	      (int)(win->seq[win->first % RINGBUF_WINDOW] - ack) <= 0)
+		win->first++;
+}
+
+/*
+ * offset in a lane slice of @lane_sz bytes for a payload of @len, the
+ * slice being used as a ring from the oldest unacked message to @pt,
+ * where the next one would go. -ENOBUFS if it does not fit yet.
+ */
+static inline long rbwindow_alloc(rbwindow *win, unsigned int pt,
+				unsigned int lane_sz, size_t len)
+{
+	unsigned int oldest, newest;
+
+	if(win->last - win->first >= RINGBUF_WINDOW)
+		return -ENOBUFS;
+
+	if(win->first == win->last)
+		return (pt + len > lane_sz) ? 0 : pt;
+
+	oldest = win->off[win->first % RINGBUF_WINDOW];
+	newest = win->off[(win->last - 1) % RINGBUF_WINDOW];
+
+	/* not wrapped yet: room up to the end, or from 0 to the oldest */
+	if(newest >= oldest) {
+		if(pt + len <= lane_sz)
+			return pt;
+		return (len <= oldest) ? 0 : -ENOBUFS;
+	}
+
+	/* not "? pt : -ENOBUFS", that would be an unsigned offset */
+	if(pt + len <= oldest)
+		return pt;
+	return -ENOBUFS;
+}
+
+/*
+ * remember a published message, at offset @off of the lane slice, or
+ * with its payload @data if it is inline. An inline message takes the
+ * offset of the one before it: at the end of the used part of the
+ * slice, it would look like the slice wrapped when it did not.
+ */
+static inline void rbwindow_push(rbwindow *win, const rbmsg_hd *hd,
+				unsigned int off, const void *data)
+{
+	unsigned int i = win->last % RINGBUF_WINDOW;
+
+	if(hd->flags & RBMSG_INLINE) {
+		memcpy(win->data[i], data, hd->payload_len);
+		if(win->first != win->last)
+			off = win->off[(win->last - 1) % RINGBUF_WINDOW];
+	}
+
+	win->seq[i] = hd->seq;
+	win->off[i] = off;
+	win->len[i] = hd->payload_len;
+	win->raw_len[i] = hd->raw_len;
+	win->flags[i] = hd->flags;
+	win->corr_id[i] = hd->corr_id;
+	win->tstamp[i] = hd->tstamp;
+	win->last++;
+}
+
+#endif /* _RINGBUF_CORE_H */
@@ -0,0 +1,421 @@
+/*
+ * ringbuf_net.c - Ethernet link between two VMs over the ring, on top of
+ * the in-kernel interface of ringbuf. Each queue sends on a channel the
+ * other end consumes and receives on one it consumes, so the two ends
+ * swap RX_CHAN and TX_CHAN:
+ *
+ *	VM a: insmod ringbuf_net.ko RX_CHAN=4 TX_CHAN=6 QUEUES=2
+ *	VM b: insmod ringbuf_net.ko RX_CHAN=6 TX_CHAN=4 QUEUES=2
+ *
+ * A frame is one message behind a virtio_net_hdr, which carries its GSO
+ * and checksum offload state the way tun does, so TCP sends segments of
+ * up to 64KB gathered from the skb frags and nobody computes their
+ * checksum. The channel of each receive queue is served on its own
+ * MSI-X vector and drained by NAPI.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/virtio_net.h>
+
+#include "ringbuf.h"
+
+/* two channels per queue, out of RINGBUF_MAX_CHANNELS */
+#define RBNET_MAX_QUEUES	4
+
+/* longest GSO frame, whose pages must fit the frags of an skb */
+#define RBNET_GSO_MAX		65536
+
+/* frames up to this are received linear, longer ones in pages */
+#define RBNET_LINEAR		2048
+#define RBNET_HEAD		256
+
+static int RX_CHAN = 4;
+MODULE_PARM_DESC(RX_CHAN, "First channel this end receives on, one per queue.");
+module_param(RX_CHAN, int, 0400);
+
+static int TX_CHAN = 6;
+MODULE_PARM_DESC(TX_CHAN, "First channel this end sends on, the RX_CHAN of the other end.");
+module_param(TX_CHAN, int, 0400);
+
+static int QUEUES = 1;
+MODULE_PARM_DESC(QUEUES, "TX and RX queues, each on its own pair of channels.");
+module_param(QUEUES, int, 0400);
+
+/*
+ * a TX and RX queue pair and its channels
+ * @rx_list: frames received by the last poll, handed to GRO once it is
+ *	     out of the ringbuf receive lock
+ * @rx_syncp/tx_syncp: counters of the NAPI and of the xmit side
+*/
+struct rbnet_queue {
+	struct rbnet		*rn;
+	unsigned int		id;
+	struct ringbuf_chan	*rx;
+	struct ringbuf_chan	*tx;
+	struct napi_struct	napi;
+	struct sk_buff_head	rx_list;
+
+	struct u64_stats_sync	rx_syncp;
+	u64			rx_packets;
+	u64			rx_bytes;
+	u64			rx_dropped;
+
+	struct u64_stats_sync	tx_syncp;
+	u64			tx_packets;
+	u64			tx_bytes;
+	u64			tx_dropped;
+};
+
+struct rbnet {
+	struct net_device	*dev;
+	unsigned int		queues;
+	struct rbnet_queue	q[RBNET_MAX_QUEUES];
+};
+
+static struct net_device *rbnet_dev;
+
+/*
+ * copy a frame out of the ring, the head of a long one in the linear
+ * part and the rest in pages
+ */
+static struct sk_buff *rbnet_build_skb(struct rbnet_queue *q, const char *p,
+					size_t len)
+{
+	size_t head = len <= RBNET_LINEAR ? len : RBNET_HEAD;
+	struct sk_buff *skb;
+	struct page *page;
+	size_t off, n;
+	int i;
+
+	skb = napi_alloc_skb(&q->napi, head);
+	if(!skb)
+		return NULL;
+	skb_put_data(skb, p, head);
+
+	for(off = head, i = 0; off < len; off += n, i++) {
+		n = min_t(size_t, len - off, PAGE_SIZE);
+		page = i < MAX_SKB_FRAGS ? alloc_page(GFP_ATOMIC) : NULL;
+		if(!page) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		memcpy(page_address(page), p + off, n);
+		skb_add_rx_frag(skb, i, page, 0, n, PAGE_SIZE);
+	}
+
+	return skb;
+}
+
+/* receive callback, under the ringbuf receive lock */
+static void rbnet_recv(void *priv, const void *payload, size_t len,
+				u32 src, u64 tstamp)
+{
+	struct rbnet_queue *q = priv;
+	const struct virtio_net_hdr *vh = payload;
+	struct sk_buff *skb = NULL;
+
+	if(len < sizeof(*vh) + ETH_HLEN)
+		goto drop;
+
+	skb = rbnet_build_skb(q, payload + sizeof(*vh), len - sizeof(*vh));
+	if(!skb)
+		goto drop;
+	if(virtio_net_hdr_to_skb(skb, vh, true))
+		goto drop;
+	skb->protocol = eth_type_trans(skb, q->rn->dev);
+
+	__skb_queue_tail(&q->rx_list, skb);
+	return;
+
+drop:
+	kfree_skb(skb);
+	u64_stats_update_begin(&q->rx_syncp);
+	q->rx_dropped++;
+	u64_stats_update_end(&q->rx_syncp);
+}
+
+static int rbnet_poll(struct napi_struct *napi, int budget)
+{
+	struct rbnet_queue *q = container_of(napi, struct rbnet_queue, napi);
+	struct sk_buff *skb;
+	int done;
+
+	done = ringbuf_chan_poll(q->rx, rbnet_recv, q, budget);
+	if(done < 0)
+		done = 0;
+
+	while((skb = __skb_dequeue(&q->rx_list))) {
+		u64_stats_update_begin(&q->rx_syncp);
+		q->rx_packets++;
+		q->rx_bytes += skb->len;
+		u64_stats_update_end(&q->rx_syncp);
+		napi_gro_receive(napi, skb);
+	}
+
+	/* an arrival during the poll has NAPI run again */
+	if(done < budget)
+		napi_complete_done(napi, done);
+
+	return done;
+}
+
+static void rbnet_arrival(void *priv)
+{
+	struct rbnet_queue *q = priv;
+
+	napi_schedule(&q->napi);
+}
+
+static void rbnet_space(void *priv)
+{
+	struct rbnet_queue *q = priv;
+
+	netif_wake_subqueue(q->rn->dev, q->id);
+}
+
+static netdev_tx_t rbnet_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct rbnet *rn = netdev_priv(dev);
+	struct rbnet_queue *q = &rn->q[skb_get_queue_mapping(skb)];
+	struct kvec iov[MAX_SKB_FRAGS + 2];
+	struct virtio_net_hdr vh;
+	unsigned int i, n = 0;
+	ssize_t ret;
+
+	if(virtio_net_hdr_from_skb(skb, &vh, true, false, 0))
+		goto drop;
+
+	/* no NETIF_F_HIGHDMA, so the frags are in the linear mapping */
+	iov[n].iov_base = &vh;
+	iov[n++].iov_len = sizeof(vh);
+	iov[n].iov_base = skb->data;
+	iov[n++].iov_len = skb_headlen(skb);
+	for(i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		iov[n].iov_base = skb_frag_address(&skb_shinfo(skb)->frags[i]);
+		iov[n++].iov_len = skb_frag_size(&skb_shinfo(skb)->frags[i]);
+	}
+
+	ret = ringbuf_chan_sendv(q->tx, iov, n, RINGBUF_NONBLOCK);
+	if(ret == -EAGAIN) {
+		/* stopped before trying again, so rbnet_space is not missed */
+		netif_stop_subqueue(dev, q->id);
+		ret = ringbuf_chan_sendv(q->tx, iov, n, RINGBUF_NONBLOCK);
+		if(ret == -EAGAIN)
+			return NETDEV_TX_BUSY;
+		netif_start_subqueue(dev, q->id);
+	}
+	if(ret < 0)
+		goto drop;
+
+	u64_stats_update_begin(&q->tx_syncp);
+	q->tx_packets++;
+	q->tx_bytes += skb->len;
+	u64_stats_update_end(&q->tx_syncp);
+	dev_consume_skb_any(skb);
+
+	return NETDEV_TX_OK;
+
+drop:
+	u64_stats_update_begin(&q->tx_syncp);
+	q->tx_dropped++;
+	u64_stats_update_end(&q->tx_syncp);
+	dev_kfree_skb_any(skb);
+
+	return NETDEV_TX_OK;
+}
+
+static int rbnet_open(struct net_device *dev)
+{
+	struct rbnet *rn = netdev_priv(dev);
+	unsigned int i;
+
+	/* and pick up what arrived while we were down */
+	for(i = 0; i < rn->queues; i++) {
+		napi_enable(&rn->q[i].napi);
+		napi_schedule(&rn->q[i].napi);
+	}
+	netif_tx_start_all_queues(dev);
+	netif_carrier_on(dev);
+
+	return 0;
+}
+
+static int rbnet_stop(struct net_device *dev)
+{
+	struct rbnet *rn = netdev_priv(dev);
+	unsigned int i;
+
+	netif_carrier_off(dev);
+	netif_tx_stop_all_queues(dev);
+	for(i = 0; i < rn->queues; i++)
+		napi_disable(&rn->q[i].napi);
+
+	return 0;
+}
+
+static void rbnet_get_stats64(struct net_device *dev,
+				struct rtnl_link_stats64 *stats)
+{
+	struct rbnet *rn = netdev_priv(dev);
+	struct rbnet_queue *q;
+	u64 packets, bytes, dropped;
+	unsigned int i, start;
+
+	for(i = 0; i < rn->queues; i++) {
+		q = &rn->q[i];
+
+		do {
+			start = u64_stats_fetch_begin(&q->rx_syncp);
+			packets = q->rx_packets;
+			bytes = q->rx_bytes;
+			dropped = q->rx_dropped;
+		} while(u64_stats_fetch_retry(&q->rx_syncp, start));
+		stats->rx_packets += packets;
+		stats->rx_bytes += bytes;
+		stats->rx_dropped += dropped;
+
+		do {
+			start = u64_stats_fetch_begin(&q->tx_syncp);
+			packets = q->tx_packets;
+			bytes = q->tx_bytes;
+			dropped = q->tx_dropped;
+		} while(u64_stats_fetch_retry(&q->tx_syncp, start));
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+		stats->tx_dropped += dropped;
+	}
+}
+
+static const struct net_device_ops rbnet_ops = {
+	.ndo_open		= rbnet_open,
+	.ndo_stop		= rbnet_stop,
+	.ndo_start_xmit		= rbnet_xmit,
+	.ndo_get_stats64	= rbnet_get_stats64,
+	.ndo_set_mac_address	= eth_mac_addr,
+	.ndo_validate_addr	= eth_validate_addr,
+};
+
+static void rbnet_close_chans(struct rbnet *rn)
+{
+	unsigned int i;
+
+	for(i = 0; i < rn->queues; i++) {
+		ringbuf_chan_close(rn->q[i].rx);
+		ringbuf_chan_close(rn->q[i].tx);
+		netif_napi_del(&rn->q[i].napi);
+	}
+}
+
+int __init rbnet_init(void)
+{
+	struct net_device *dev;
+	struct rbnet *rn;
+	struct rbnet_queue *q;
+	size_t msg_max = ringbuf_msg_max();
+	u32 ivposition = ringbuf_ivposition();
+	u8 addr[ETH_ALEN] = { 0x02, 'R', 'B', 0 };
+	unsigned int i;
+	int ret;
+
+	if(QUEUES < 1 || QUEUES > RBNET_MAX_QUEUES || RX_CHAN < 0 ||
+	   TX_CHAN < 0 || (RX_CHAN < TX_CHAN + QUEUES &&
+			   TX_CHAN < RX_CHAN + QUEUES))
+		return -EINVAL;
+	if(msg_max < sizeof(struct virtio_net_hdr) + ETH_HLEN + ETH_MIN_MTU)
+		return -ENODEV;
+
+	dev = alloc_netdev_mqs(sizeof(*rn), "rbnet%d", NET_NAME_ENUM,
+				ether_setup, QUEUES, QUEUES);
+	if(!dev)
+		return -ENOMEM;
+
+	rn = netdev_priv(dev);
+	rn->dev = dev;
+	for(i = 0; i < QUEUES; i++) {
+		q = &rn->q[i];
+		q->rn = rn;
+		q->id = i;
+		__skb_queue_head_init(&q->rx_list);
+		u64_stats_init(&q->rx_syncp);
+		u64_stats_init(&q->tx_syncp);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+		netif_napi_add(dev, &q->napi, rbnet_poll);
+#else
+		netif_napi_add(dev, &q->napi, rbnet_poll, NAPI_POLL_WEIGHT);
+#endif
+		rn->queues++;
+
+		q->rx = ringbuf_chan_open(RX_CHAN + i);
+		q->tx = ringbuf_chan_open(TX_CHAN + i);
+		if(IS_ERR(q->rx) || IS_ERR(q->tx)) {
+			ret = IS_ERR(q->rx) ? PTR_ERR(q->rx) : PTR_ERR(q->tx);
+			goto error;
+		}
+	}
+
+	dev->netdev_ops = &rbnet_ops;
+	dev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_TSO |
+			   NETIF_F_TSO6 | NETIF_F_TSO_ECN;
+	dev->features = dev->hw_features;
+	dev->max_mtu = min_t(size_t, ETH_MAX_MTU,
+			msg_max - sizeof(struct virtio_net_hdr) - ETH_HLEN);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+	netif_set_tso_max_size(dev, min_t(size_t, RBNET_GSO_MAX,
+			msg_max - sizeof(struct virtio_net_hdr)));
+#else
+	netif_set_gso_max_size(dev, min_t(size_t, RBNET_GSO_MAX,
+			msg_max - sizeof(struct virtio_net_hdr)));
+#endif
+
+	/* locally administered, after the IVPosition of the VM */
+	addr[4] = ivposition >> 8;
+	addr[5] = ivposition;
+	eth_hw_addr_set(dev, addr);
+
+	ret = register_netdev(dev);
+	if(ret)
+		goto error;
+
+	for(i = 0; i < QUEUES; i++) {
+		q = &rn->q[i];
+		ret = ringbuf_chan_notify(q->rx, rbnet_arrival, NULL, q);
+		if(!ret)
+			ret = ringbuf_chan_notify(q->tx, NULL, rbnet_space, q);
+		if(ret) {
+			printk(KERN_ERR "rbnet: channels of queue %u are busy\n", i);
+			unregister_netdev(dev);
+			goto error;
+		}
+	}
+
+	rbnet_dev = dev;
+	printk(KERN_INFO "rbnet: %s %pM, %d queues, rx channel %d, tx channel %d, mtu up to %u\n",
+		dev->name, dev->dev_addr, QUEUES, RX_CHAN, TX_CHAN,
+		dev->max_mtu);
+
+	return 0;
+
+error:
+	rbnet_close_chans(rn);
+	free_netdev(dev);
+	return ret;
+}
+
+void __exit rbnet_exit(void)
+{
+	/* no callback runs once the channels are closed */
+	unregister_netdev(rbnet_dev);
+	rbnet_close_chans(netdev_priv(rbnet_dev));
+	free_netdev(rbnet_dev);
+}
+
+module_init(rbnet_init);
+module_exit(rbnet_exit);
+
+MODULE_LICENSE("GPL");
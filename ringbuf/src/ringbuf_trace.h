@@ -0,0 +1,132 @@
+/*
+ * tracepoints of the ringbuf driver, under events/ringbuf
+ *
+ * A lane is the pair (producer IVPosition, channel). @off is the offset
+ * of the payload in the payload area, @used the ring occupancy right
+ * after the event.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ringbuf
+
+#if !defined(_RINGBUF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RINGBUF_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(ringbuf_msg,
+
+	TP_PROTO(unsigned int chan, unsigned int src, unsigned int seq,
+		 unsigned int off, unsigned int len, unsigned int used),
+
+	TP_ARGS(chan, src, seq, off, len, used),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, chan)
+		__field(unsigned int, src)
+		__field(unsigned int, seq)
+		__field(unsigned int, off)
+		__field(unsigned int, len)
+		__field(unsigned int, used)
+	),
+
+	TP_fast_assign(
+		__entry->chan = chan;
+		__entry->src = src;
+		__entry->seq = seq;
+		__entry->off = off;
+		__entry->len = len;
+		__entry->used = used;
+	),
+
+	TP_printk("lane %u:%u seq %u off 0x%x len %u used %u",
+		  __entry->src, __entry->chan, __entry->seq,
+		  __entry->off, __entry->len, __entry->used)
+);
+
+/* a message header published in a ring, sent or retransmitted */
+DEFINE_EVENT(ringbuf_msg, ringbuf_enqueue,
+
+	TP_PROTO(unsigned int chan, unsigned int src, unsigned int seq,
+		 unsigned int off, unsigned int len, unsigned int used),
+
+	TP_ARGS(chan, src, seq, off, len, used)
+);
+
+/* a message consumed from a ring */
+DEFINE_EVENT(ringbuf_msg, ringbuf_dequeue,
+
+	TP_PROTO(unsigned int chan, unsigned int src, unsigned int seq,
+		 unsigned int off, unsigned int len, unsigned int used),
+
+	TP_ARGS(chan, src, seq, off, len, used)
+);
+
+TRACE_EVENT(ringbuf_doorbell,
+
+	TP_PROTO(unsigned int peer, unsigned int vector),
+
+	TP_ARGS(peer, vector),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, peer)
+		__field(unsigned int, vector)
+	),
+
+	TP_fast_assign(
+		__entry->peer = peer;
+		__entry->vector = vector;
+	),
+
+	TP_printk("peer %u vector %u", __entry->peer, __entry->vector)
+);
+
+TRACE_EVENT(ringbuf_interrupt,
+
+	TP_PROTO(int irq),
+
+	TP_ARGS(irq),
+
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+
+	TP_printk("irq %d", __entry->irq)
+);
+
+/* one channel visited by the tasklet */
+TRACE_EVENT(ringbuf_drain,
+
+	TP_PROTO(unsigned int chan, unsigned int mode, unsigned int msgs,
+		 unsigned int used),
+
+	TP_ARGS(chan, mode, msgs, used),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, chan)
+		__field(unsigned int, mode)
+		__field(unsigned int, msgs)
+		__field(unsigned int, used)
+	),
+
+	TP_fast_assign(
+		__entry->chan = chan;
+		__entry->mode = mode;
+		__entry->msgs = msgs;
+		__entry->used = used;
+	),
+
+	TP_printk("chan %u mode %u msgs %u used %u",
+		  __entry->chan, __entry->mode, __entry->msgs, __entry->used)
+);
+
+#endif /* _RINGBUF_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ringbuf_trace
+#include <trace/define_trace.h>
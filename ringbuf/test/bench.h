@@ -0,0 +1,46 @@
+/*
+ * shared by the throughput benchmark modules bench_tx and bench_rx
+ */
+#ifndef _RINGBUF_BENCH_H
+#define _RINGBUF_BENCH_H
+
+#include "../src/ringbuf.h"
+
+#define BENCH_MAGIC		0x42454e43	/* "BENC" */
+#define BENCH_MAX_SZ		4096
+#define BENCH_MAX_THREADS	16
+
+/* message size distributions of bench_tx */
+enum {
+	SizeFixed	=	0,	/* always msg_size */
+	SizeUniform	=	1,	/* uniform in [msg_size, msg_size_max] */
+	SizeBimodal	=	2,	/* msg_size, one in ten msg_size_max */
+};
+
+/*
+ * head of every benchmark message, the rest is filler
+ * @peer: IVPosition of the sender
+ * @thread: producer thread of the sender
+ * @seq: per thread sequence number, from 0
+ * @tstamp: CLOCK_REALTIME of the send, in ns
+*/
+struct bench_hd {
+	u32 magic;
+	u16 peer;
+	u16 thread;
+	u64 seq;
+	u64 tstamp;
+};
+
+/* ops per second and MB per second over ns */
+static inline u64 bench_rate(u64 n, u64 ns)
+{
+	return ns ? div64_u64(n * NSEC_PER_SEC, ns) : 0;
+}
+
+static inline u64 bench_mbps(u64 bytes, u64 ns)
+{
+	return ns ? div64_u64(bytes * 1000, ns) : 0;
+}
+
+#endif /* _RINGBUF_BENCH_H */
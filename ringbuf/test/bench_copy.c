@@ -0,0 +1,155 @@
+/*
+ * crossover points of the payload copy engines of ringbuf_copy.h: the
+ * time each engine this CPU has takes to copy 64 bytes up to size_max,
+ * into a hot destination (the same buffer over and over, like a
+ * consumer's receive buffer) and a cold one (walking buf_mb of memory,
+ * like a producer's lane slices only the peer VM reads). Reported in
+ * dmesg with the COPY_VEC_MIN and COPY_NT_MIN they suggest for the
+ * driver on this CPU.
+ *
+ *	insmod bench_copy.ko size_max=1048576 buf_mb=64
+ *
+ * No IVshmem device is needed, run it in the VM that will run the
+ * driver since the guest CPU model decides which engines there are.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+
+#include "../src/ringbuf_copy.h"
+
+static int size_max = 1 << 20;
+MODULE_PARM_DESC(size_max, "Largest copy, sizes go up from 64 bytes in powers of 2.");
+module_param(size_max, int, 0400);
+
+static int buf_mb = 64;
+MODULE_PARM_DESC(buf_mb, "MB walked by the cold destination, beyond the last level cache.");
+module_param(buf_mb, int, 0400);
+
+static int bytes_mb = 256;
+MODULE_PARM_DESC(bytes_mb, "MB copied for each size and engine.");
+module_param(bytes_mb, int, 0400);
+
+static char *src, *dst;
+static size_t dst_sz;
+static struct task_struct *task;
+
+/* ns per copy of len bytes, into the start of dst or walking all of it */
+static u64 bench_engine(unsigned int engine, size_t len, bool cold)
+{
+	u64 n = max_t(u64, ((u64)bytes_mb << 20) / len, 16), i, t0;
+	size_t off = 0;
+
+	/* warm up the source and, if hot, the destination */
+	rbcopy_run(engine, dst, src, len);
+
+	t0 = ktime_get_ns();
+	for(i = 0; i < n; i++) {
+		rbcopy_run(engine, dst + off, src, len);
+		if(cold) {
+			off += ALIGN(len, 64);
+			if(off + len > dst_sz)
+				off = 0;
+		}
+		if(i % 1024 == 1023)
+			cond_resched();
+	}
+
+	return div64_u64(ktime_get_ns() - t0, n);
+}
+
+static int bench_copy_fn(void *data)
+{
+	u64 ns[2][CopyEngines];
+	size_t len, vec_min = 0, nt_min = 0;
+	unsigned int e, small, large, best, cold;
+	char line[160];
+	int pos;
+
+	small = rbcopy_supported(CopyErms) ? CopyErms : CopyMemcpy;
+	large = rbcopy_supported(CopyAvx512) ? CopyAvx512 :
+		rbcopy_supported(CopyAvx2) ? CopyAvx2 : small;
+
+	printk(KERN_INFO "bench_copy: ns per copy, hot / cold destination\n");
+	for(len = 64; len <= size_max; len *= 2) {
+		pos = scnprintf(line, sizeof(line), "%8zu", len);
+		for(e = 0; e < CopyEngines; e++) {
+			if(!rbcopy_supported(e)) {
+				ns[0][e] = ns[1][e] = U64_MAX;
+				continue;
+			}
+			for(cold = 0; cold < 2; cold++)
+				ns[cold][e] = bench_engine(e, len, cold);
+			pos += scnprintf(line + pos, sizeof(line) - pos,
+				"  %s %llu/%llu", rbcopy_names[e],
+				ns[0][e], ns[1][e]);
+			if(kthread_should_stop())
+				return 0;
+		}
+
+		best = CopyMemcpy;
+		for(e = 0; e < CopyEngines; e++)
+			if(ns[1][e] < ns[1][best])
+				best = e;
+		printk(KERN_INFO "bench_copy: %s  cold best %s\n", line,
+			rbcopy_names[best]);
+
+		/* the first sizes from which the driver should switch */
+		if(!vec_min && large != small && ns[0][large] < ns[0][small])
+			vec_min = len;
+		if(!nt_min && best == CopyNt)
+			nt_min = len;
+	}
+
+	printk(KERN_INFO "bench_copy: suggested COPY_VEC_MIN=%zu COPY_NT_MIN=%zu (0 never)\n",
+		vec_min, nt_min);
+
+	while(!kthread_should_stop())
+		schedule_timeout_interruptible(HZ);
+
+	return 0;
+}
+
+int __init bench_copy_init(void)
+{
+	if(size_max < 64 || buf_mb < 1 || bytes_mb < 1 ||
+	   (size_t)size_max > (size_t)buf_mb << 20)
+		return -EINVAL;
+
+	dst_sz = (size_t)buf_mb << 20;
+	src = vmalloc(size_max);
+	dst = vmalloc(dst_sz);
+	if(!src || !dst)
+		goto error;
+	get_random_bytes(src, size_max);
+	memset(dst, 0, dst_sz);
+
+	task = kthread_run(bench_copy_fn, NULL, "bench_copy");
+	if(!IS_ERR(task))
+		return 0;
+
+	vfree(src);
+	vfree(dst);
+	return PTR_ERR(task);
+
+error:
+	vfree(src);
+	vfree(dst);
+	return -ENOMEM;
+}
+
+void __exit bench_copy_exit(void)
+{
+	kthread_stop(task);
+	vfree(src);
+	vfree(dst);
+}
+
+module_init(bench_copy_init);
+module_exit(bench_copy_exit);
+
+MODULE_LICENSE("GPL");
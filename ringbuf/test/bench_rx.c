@@ -0,0 +1,146 @@
+/*
+ * throughput benchmark, consumer side: receives channel 0 through the
+ * in-kernel interface of ringbuf, in its tasklet, and reports each run
+ * of bench_tx in dmesg once nothing arrived for idle_ms.
+ *
+ *	insmod ringbuf.ko ROLE=0 LOG_MSGS=0
+ *	insmod bench_rx.ko
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+
+#include "bench.h"
+
+#define BENCH_PEERS		16
+
+static int idle_ms = 2000;
+MODULE_PARM_DESC(idle_ms, "Milliseconds without messages that end a run.");
+module_param(idle_ms, int, 0400);
+
+/*
+ * what arrived in the current run
+ * @expect: next sequence number of each (peer, thread)
+ * @lost: messages skipped in the sequence, dropped by the producer or
+ *	  lost to a ring reset
+*/
+struct bench_run {
+	u64 msgs;
+	u64 bytes;
+	u64 lost;
+	u64 bad;
+	u64 first;
+	u64 last;
+	u64 expect[BENCH_PEERS][BENCH_MAX_THREADS];
+};
+
+static struct ringbuf_chan *rc;
+static struct task_struct *task;
+static DEFINE_SPINLOCK(run_lock);
+static struct bench_run run;
+
+static void bench_report(void)
+{
+	u64 ns = run.last - run.first;
+
+	printk(KERN_INFO "bench_rx: %llu msgs %llu bytes in %llu ms\n",
+		run.msgs, run.bytes, div64_u64(ns, NSEC_PER_MSEC));
+	printk(KERN_INFO "bench_rx: %llu msgs/s %llu MB/s, %llu lost, %llu bad\n",
+		bench_rate(run.msgs, ns), bench_mbps(run.bytes, ns),
+		run.lost, run.bad);
+
+	memset(&run, 0, sizeof(run));
+}
+
+/* receive callback, from the tasklet of ringbuf */
+static void bench_account(void *priv, const void *payload, size_t len,
+				u32 src, u64 tstamp)
+{
+	const struct bench_hd *hd = payload;
+	u64 *expect;
+
+	spin_lock(&run_lock);
+	if(!run.msgs)
+		run.first = ktime_get_ns();
+	run.last = ktime_get_ns();
+	run.msgs++;
+	run.bytes += len;
+
+	if(len < sizeof(*hd) || hd->magic != BENCH_MAGIC ||
+	   hd->thread >= BENCH_MAX_THREADS) {
+		run.bad++;
+		goto out;
+	}
+
+	/* a new run of the producer starts over from 0 */
+	expect = &run.expect[hd->peer % BENCH_PEERS][hd->thread];
+	if(hd->seq > *expect)
+		run.lost += hd->seq - *expect;
+	if(hd->seq >= *expect || hd->seq == 0)
+		*expect = hd->seq + 1;
+out:
+	spin_unlock(&run_lock);
+}
+
+/* reports the runs once they went idle */
+static int bench_rx_fn(void *data)
+{
+	while(!kthread_should_stop()) {
+		schedule_timeout_interruptible(msecs_to_jiffies(100));
+
+		spin_lock_bh(&run_lock);
+		if(run.msgs && ktime_get_ns() - run.last >=
+				(u64)idle_ms * NSEC_PER_MSEC)
+			bench_report();
+		spin_unlock_bh(&run_lock);
+	}
+
+	spin_lock_bh(&run_lock);
+	if(run.msgs)
+		bench_report();
+	spin_unlock_bh(&run_lock);
+
+	return 0;
+}
+
+int __init bench_rx_init(void)
+{
+	int ret;
+
+	rc = ringbuf_chan_open(0);
+	if(IS_ERR(rc))
+		return PTR_ERR(rc);
+
+	task = kthread_run(bench_rx_fn, NULL, "bench_rx");
+	if(IS_ERR(task)) {
+		ringbuf_chan_close(rc);
+		return PTR_ERR(task);
+	}
+
+	ret = ringbuf_chan_recv(rc, bench_account, NULL);
+	if(ret < 0) {
+		kthread_stop(task);
+		ringbuf_chan_close(rc);
+		return ret;
+	}
+
+	printk(KERN_INFO "bench_rx: waiting for messages on channel 0\n");
+	return 0;
+}
+
+void __exit bench_rx_exit(void)
+{
+	/* no callback runs once the channel is closed */
+	ringbuf_chan_close(rc);
+	kthread_stop(task);
+}
+
+module_init(bench_rx_init);
+module_exit(bench_rx_exit);
+
+MODULE_LICENSE("GPL");
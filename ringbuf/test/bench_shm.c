@@ -0,0 +1,600 @@
+/*
+ * microbenchmarks of the primitives the ring is built from, between
+ * VMs sharing the IVshmem device: cache line ping-pong, CAS and
+ * fetch-add under 1 to peers contending VMs, store to load visibility
+ * and doorbell to interrupt latency. Each test runs with BAR2 mapped
+ * uncached, write-combining and write-back, and the results go to dmesg.
+ *
+ * It drives the device itself, load it instead of ringbuf in every VM,
+ * VM 0 last since it starts the run:
+ *
+ *	VM 1: insmod bench_shm.ko vm=1 peers=2
+ *	VM 0: insmod bench_shm.ko vm=0 peers=2
+ *
+ * Ping-pong, visibility and doorbell run between VM 0 and 1, the
+ * others only take part in the atomics. Visibility uses CLOCK_REALTIME
+ * across VMs, like the latency histograms of the driver.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/pci.h>
+#include <linux/interrupt.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+
+#define SHM_MAGIC		0x53484d42	/* "SHMB" */
+#define SHM_MAX_PEERS		4
+#define SHM_CTL_SZ		0x1000
+#define SHM_WIN_SZ		0x10000
+#define SHM_TIMEOUT_MSEC	30000
+#define DOORBELL_OFF		0x0c
+#define IVPOSITION_OFF		0x08
+#define DOORBELL_VAL(peer, vector)	(((peer) << 16) | ((vector) & 0xffff))
+
+static int vm = 0;
+MODULE_PARM_DESC(vm, "Index of this VM in the run, 0 starts it and must be loaded last.");
+module_param(vm, int, 0400);
+
+static int peers = 2;
+MODULE_PARM_DESC(peers, "VMs taking part, 1 to 4.");
+module_param(peers, int, 0400);
+
+static int iters = 10000;
+MODULE_PARM_DESC(iters, "Round trips of the latency tests.");
+module_param(iters, int, 0400);
+
+static int duration_ms = 1000;
+MODULE_PARM_DESC(duration_ms, "Milliseconds of each atomics run.");
+module_param(duration_ms, int, 0400);
+
+static int modes = 0x7;
+MODULE_PARM_DESC(modes, "Mappings to test: bit 0 uncached, 1 write-combining, 2 write-back.");
+module_param(modes, int, 0400);
+
+/*
+ * mapping modes of BAR2. Each gets its own window of BAR2 since x86
+ * refuses to map the same range with two memory types.
+ */
+enum {
+	MapUC	=	0,
+	MapWC	=	1,
+	MapWB	=	2,
+	MapModes,
+};
+
+static const char * const map_names[MapModes] = { "uc", "wc", "wb" };
+
+/*
+ * what each VM shares with the others, in the always uncached control
+ * page at the start of BAR2, one cache line each
+ * @arrive: last barrier round this VM reached
+ * @ops: operations of the last atomics run
+*/
+struct shm_slot {
+	u32 ivposition;
+	u32 arrive;
+	u64 ops;
+} ____cacheline_aligned;
+
+struct shm_ctl {
+	u32 magic;
+	u32 session;
+	struct shm_slot slot[SHM_MAX_PEERS] ____cacheline_aligned;
+};
+
+/*
+ * a test window, each field on its own cache line
+ * @line: the ping-pong line
+ * @counter: target of the atomics
+ * @seq, @tstamp: written by VM 0 for the visibility and doorbell tests
+ * @ack: written back by VM 1
+*/
+struct shm_win {
+	u32 line ____cacheline_aligned;
+	atomic_t counter ____cacheline_aligned;
+	u32 seq ____cacheline_aligned;
+	u64 tstamp;
+	u32 ack ____cacheline_aligned;
+};
+
+static void __iomem *regs;
+static struct shm_ctl *ctl;
+static struct shm_win *win[MapModes];
+static struct shm_win *cur;
+static struct task_struct *task;
+static u64 *samples;
+static int nsamples;
+static u32 round;
+
+#define LOAD(x)		READ_ONCE(x)
+#define STORE(x, v)	do { WRITE_ONCE(x, v); wmb(); } while (0)
+
+/* spin until *p == want, -ETIMEDOUT after SHM_TIMEOUT_MSEC */
+static int bench_spin(u32 *p, u32 want)
+{
+	u64 end = ktime_get_ns() + (u64)SHM_TIMEOUT_MSEC * NSEC_PER_MSEC;
+	unsigned int i = 0;
+
+	while(LOAD(*p) != want) {
+		cpu_relax();
+		if(++i % 1024 == 0 && (kthread_should_stop() ||
+					ktime_get_ns() > end))
+			return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/* wait for every VM to get to the same point */
+static int bench_sync(void)
+{
+	u64 end = ktime_get_ns() + (u64)SHM_TIMEOUT_MSEC * NSEC_PER_MSEC;
+	int i;
+
+	round++;
+	STORE(ctl->slot[vm].arrive, round);
+
+	for(i = 0; i < peers; i++) {
+		while((int)(LOAD(ctl->slot[i].arrive) - round) < 0) {
+			if(kthread_should_stop() || ktime_get_ns() > end) {
+				printk(KERN_ERR "bench_shm: VM %d did not reach round %u\n",
+					i, round);
+				return -ETIMEDOUT;
+			}
+			usleep_range(10, 20);
+		}
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(int mode, const char *test)
+{
+	u64 sum = 0;
+	int i;
+
+	if(!nsamples)
+		return;
+
+	sort(samples, nsamples, sizeof(*samples), cmp_u64, NULL);
+	for(i = 0; i < nsamples; i++)
+		sum += samples[i];
+
+	printk(KERN_INFO "bench_shm: [%s] %s ns: min %llu mean %llu p50 %llu p99 %llu max %llu\n",
+		map_names[mode], test, samples[0], div64_u64(sum, nsamples),
+		samples[nsamples / 2], samples[(u64)nsamples * 99 / 100],
+		samples[nsamples - 1]);
+	nsamples = 0;
+}
+
+/*
+ * round trips of one cache line between VM 0 and 1: 0 writes odd
+ * values, 1 answers with the next even one
+ */
+static int bench_pingpong(int mode)
+{
+	struct shm_win *w = win[mode];
+	u64 t0;
+	int i, ret;
+
+	if(vm == 0)
+		STORE(w->line, 0);
+	ret = bench_sync();
+	if(ret || vm > 1)
+		return ret;
+
+	for(i = 0; i < iters; i++) {
+		if(vm == 0) {
+			t0 = ktime_get_ns();
+			STORE(w->line, 2 * i + 1);
+			ret = bench_spin(&w->line, 2 * i + 2);
+			samples[nsamples++] = ktime_get_ns() - t0;
+		} else {
+			ret = bench_spin(&w->line, 2 * i + 1);
+			STORE(w->line, 2 * i + 2);
+		}
+		if(ret)
+			return ret;
+	}
+
+	if(vm == 0)
+		bench_report(mode, "ping-pong round trip");
+	return 0;
+}
+
+/*
+ * one atomics run with the first n VMs hammering the counter, either
+ * CAS increments (counting the failed ones) or fetch-adds. VM 0
+ * then checks that no increment was lost.
+ */
+static int bench_atomic_run(int mode, int n, bool cas)
+{
+	atomic_t *counter = &win[mode]->counter;
+	u64 end, ops = 0, fails = 0, total = 0;
+	int i, old, ret;
+
+	if(vm == 0)
+		atomic_set(counter, 0);
+	ret = bench_sync();
+	if(ret)
+		return ret;
+
+	if(vm < n) {
+		end = ktime_get_ns() + (u64)duration_ms * NSEC_PER_MSEC;
+		while(ktime_get_ns() < end) {
+			for(i = 0; i < 256; i++) {
+				if(cas) {
+					old = atomic_read(counter);
+					if(atomic_cmpxchg(counter, old, old + 1) != old) {
+						fails++;
+						continue;
+					}
+				} else {
+					atomic_fetch_add(1, counter);
+				}
+				ops++;
+			}
+		}
+	}
+	STORE(ctl->slot[vm].ops, ops);
+
+	ret = bench_sync();
+	if(ret)
+		return ret;
+
+	if(vm < n)
+		printk(KERN_INFO "bench_shm: [%s] %s %d VMs: VM %d %llu ops/s, %llu failed\n",
+			map_names[mode], cas ? "cas" : "fetch-add", n, vm,
+			div64_u64(ops * MSEC_PER_SEC, duration_ms), fails);
+
+	if(vm == 0) {
+		for(i = 0; i < n; i++)
+			total += LOAD(ctl->slot[i].ops);
+		printk(KERN_INFO "bench_shm: [%s] %s %d VMs: %llu ops/s in all, %lld increments lost\n",
+			map_names[mode], cas ? "cas" : "fetch-add", n,
+			div64_u64(total * MSEC_PER_SEC, duration_ms),
+			(s64)total - (u32)atomic_read(counter));
+	}
+
+	return 0;
+}
+
+static int bench_atomics(int mode)
+{
+	int n, ret;
+
+	for(n = 1; n <= peers; n++) {
+		ret = bench_atomic_run(mode, n, true);
+		if(!ret)
+			ret = bench_atomic_run(mode, n, false);
+		if(ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * one-way delay from a store of VM 0 until VM 1 loads it: 0
+ * stores its clock then the sequence number, 1 spins on the sequence
+ * number and acks it before the next one
+ */
+static int bench_visibility(int mode)
+{
+	struct shm_win *w = win[mode];
+	u64 now;
+	int i, ret;
+
+	if(vm == 0) {
+		STORE(w->seq, 0);
+		STORE(w->ack, 0);
+	}
+	ret = bench_sync();
+	if(ret || vm > 1)
+		return ret;
+
+	for(i = 1; i <= iters; i++) {
+		if(vm == 0) {
+			WRITE_ONCE(w->tstamp, ktime_get_real_ns());
+			wmb();
+			STORE(w->seq, i);
+			ret = bench_spin(&w->ack, i);
+		} else {
+			ret = bench_spin(&w->seq, i);
+			now = ktime_get_real_ns();
+			rmb();
+			samples[nsamples++] = max_t(s64, 0,
+				(s64)(now - LOAD(w->tstamp)));
+			STORE(w->ack, i);
+		}
+		if(ret)
+			return ret;
+	}
+
+	if(vm == 1)
+		bench_report(mode, "store to load");
+	return 0;
+}
+
+/*
+ * VM 1 takes the delay from the doorbell write of VM 0 to its
+ * interrupt handler, then acks
+ */
+static irqreturn_t bench_interrupt(int irq, void *dev_id)
+{
+	struct shm_win *w = READ_ONCE(cur);
+
+	if(!w || vm != 1)
+		return IRQ_HANDLED;
+
+	if(nsamples < iters)
+		samples[nsamples++] = max_t(s64, 0,
+			(s64)(ktime_get_real_ns() - LOAD(w->tstamp)));
+	STORE(w->ack, LOAD(w->seq));
+
+	return IRQ_HANDLED;
+}
+
+static int bench_doorbell(int mode)
+{
+	struct shm_win *w = win[mode];
+	u32 peer = LOAD(ctl->slot[1].ivposition);
+	int i, ret;
+
+	if(vm == 0) {
+		STORE(w->seq, 0);
+		STORE(w->ack, 0);
+	}
+	WRITE_ONCE(cur, w);
+	ret = bench_sync();
+	if(ret || vm != 0)
+		goto out;
+
+	for(i = 1; i <= iters; i++) {
+		WRITE_ONCE(w->tstamp, ktime_get_real_ns());
+		WRITE_ONCE(w->seq, i);
+		wmb();
+		iowrite32(DOORBELL_VAL(peer, 0), regs + DOORBELL_OFF);
+		ret = bench_spin(&w->ack, i);
+		if(ret)
+			goto out;
+	}
+
+out:
+	/* VM 1 reports once VM 0 is done */
+	if(!ret)
+		ret = bench_sync();
+	WRITE_ONCE(cur, NULL);
+	if(!ret && vm == 1)
+		bench_report(mode, "doorbell to interrupt");
+	return ret;
+}
+
+static int bench_shm_fn(void *data)
+{
+	u32 session = LOAD(ctl->session);
+	u64 end;
+	int mode, ret = 0;
+
+	/* VM 0 opens a new session, the others wait for it */
+	if(vm == 0) {
+		memset_io(ctl, 0, sizeof(*ctl));
+		STORE(ctl->session, get_random_u32() | 1);
+		STORE(ctl->magic, SHM_MAGIC);
+	} else {
+		end = ktime_get_ns() + 10ULL * SHM_TIMEOUT_MSEC * NSEC_PER_MSEC;
+		while(LOAD(ctl->magic) != SHM_MAGIC ||
+		      LOAD(ctl->session) == session) {
+			if(kthread_should_stop() || ktime_get_ns() > end) {
+				ret = -ETIMEDOUT;
+				goto out;
+			}
+			msleep(10);
+		}
+	}
+	STORE(ctl->slot[vm].ivposition, ioread32(regs + IVPOSITION_OFF));
+
+	ret = bench_sync();
+	if(ret)
+		goto out;
+	printk(KERN_INFO "bench_shm: VM %d of %d, %d iterations\n",
+		vm, peers, iters);
+
+	for(mode = 0; mode < MapModes && !ret; mode++) {
+		if(!(modes & BIT(mode)) || !win[mode])
+			continue;
+		if(peers > 1)
+			ret = bench_pingpong(mode);
+		if(!ret)
+			ret = bench_atomics(mode);
+		if(!ret && peers > 1)
+			ret = bench_visibility(mode);
+		if(!ret && peers > 1)
+			ret = bench_doorbell(mode);
+	}
+
+out:
+	if(ret)
+		printk(KERN_ERR "bench_shm: run aborted: %d\n", ret);
+	else
+		printk(KERN_INFO "bench_shm: done\n");
+
+	/* kthread_stop() at rmmod collects us */
+	while(!kthread_should_stop())
+		schedule_timeout_interruptible(HZ);
+
+	return 0;
+}
+
+static void bench_unmap(void)
+{
+	int mode;
+
+	for(mode = 0; mode < MapModes; mode++) {
+		if(win[mode])
+			iounmap(win[mode]);
+		win[mode] = NULL;
+	}
+	if(ctl)
+		iounmap(ctl);
+	ctl = NULL;
+}
+
+static int bench_map(struct pci_dev *pdev)
+{
+	resource_size_t start = pci_resource_start(pdev, 2);
+	resource_size_t off;
+	void __iomem *p;
+	int mode;
+
+	if(pci_resource_len(pdev, 2) < SHM_CTL_SZ + MapModes * SHM_WIN_SZ)
+		return -ENOSPC;
+
+	ctl = (struct shm_ctl *)ioremap(start, SHM_CTL_SZ);
+	if(!ctl)
+		return -ENOMEM;
+
+	for(mode = 0; mode < MapModes; mode++) {
+		off = start + SHM_WIN_SZ * (mode + 1);
+		switch(mode) {
+		case MapUC:
+			p = ioremap(off, SHM_WIN_SZ);
+			break;
+		case MapWC:
+			p = ioremap_wc(off, SHM_WIN_SZ);
+			break;
+		default:
+			p = ioremap_cache(off, SHM_WIN_SZ);
+			break;
+		}
+		if(!p)
+			printk(KERN_WARNING "bench_shm: cannot map BAR2 %s\n",
+				map_names[mode]);
+		win[mode] = (struct shm_win *)p;
+	}
+
+	return 0;
+}
+
+static int bench_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
+{
+	int ret;
+
+	ret = pci_enable_device(pdev);
+	if(ret)
+		return ret;
+
+	ret = pci_request_regions(pdev, "bench_shm");
+	if(ret)
+		goto disable_device;
+
+	regs = pci_iomap(pdev, 0, 0);
+	if(!regs) {
+		ret = -ENOMEM;
+		goto release_regions;
+	}
+
+	ret = bench_map(pdev);
+	if(ret)
+		goto unmap;
+
+	ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSIX);
+	if(ret < 0)
+		goto unmap;
+	ret = request_irq(pci_irq_vector(pdev, 0), bench_interrupt, 0,
+			"bench_shm", pdev);
+	if(ret)
+		goto free_vectors;
+
+	task = kthread_run(bench_shm_fn, NULL, "bench_shm");
+	if(IS_ERR(task)) {
+		ret = PTR_ERR(task);
+		task = NULL;
+		goto free_irq;
+	}
+
+	return 0;
+
+free_irq:
+	free_irq(pci_irq_vector(pdev, 0), pdev);
+free_vectors:
+	pci_free_irq_vectors(pdev);
+unmap:
+	bench_unmap();
+	pci_iounmap(pdev, regs);
+release_regions:
+	pci_release_regions(pdev);
+disable_device:
+	pci_disable_device(pdev);
+	return ret;
+}
+
+static void bench_remove(struct pci_dev *pdev)
+{
+	if(task)
+		kthread_stop(task);
+	task = NULL;
+
+	free_irq(pci_irq_vector(pdev, 0), pdev);
+	pci_free_irq_vectors(pdev);
+	bench_unmap();
+	pci_iounmap(pdev, regs);
+	pci_release_regions(pdev);
+	pci_disable_device(pdev);
+}
+
+static struct pci_device_id bench_id_table[] = {
+	{ 0x1af4, 0x1110, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ 0 },
+};
+
+static struct pci_driver bench_pci_driver = {
+	.name		= "bench_shm",
+	.id_table	= bench_id_table,
+	.probe		= bench_probe,
+	.remove		= bench_remove,
+};
+
+int __init bench_shm_init(void)
+{
+	int ret;
+
+	if(vm < 0 || vm >= SHM_MAX_PEERS || peers < 1 ||
+	   peers > SHM_MAX_PEERS || vm >= peers || iters < 1 ||
+	   duration_ms < 1)
+		return -EINVAL;
+
+	samples = vmalloc(array_size(iters, sizeof(*samples)));
+	if(!samples)
+		return -ENOMEM;
+
+	ret = pci_register_driver(&bench_pci_driver);
+	if(ret)
+		vfree(samples);
+
+	return ret;
+}
+
+void __exit bench_shm_exit(void)
+{
+	pci_unregister_driver(&bench_pci_driver);
+	vfree(samples);
+}
+
+module_init(bench_shm_init);
+module_exit(bench_shm_exit);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,255 @@
+/*
+ * throughput benchmark, producer side: threads sending to channel 0
+ * through the in-kernel interface of ringbuf as fast as the ring takes it or at a target rate, reported in dmesg
+ * when done. Pair it with bench_rx in the consumer VM.
+ *
+ *	insmod bench_tx.ko msg_size=64 count=1000000 threads=2
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/atomic.h>
+#include <asm/timex.h>
+
+#include "bench.h"
+
+static int msg_size = 64;
+MODULE_PARM_DESC(msg_size, "Message size in bytes, the smallest one if sizes vary.");
+module_param(msg_size, int, 0400);
+
+static int msg_size_max = 0;
+MODULE_PARM_DESC(msg_size_max, "Largest message size in bytes for size_dist 1 and 2.");
+module_param(msg_size_max, int, 0400);
+
+static int size_dist = SizeFixed;
+MODULE_PARM_DESC(size_dist, "Message sizes: 0 fixed, 1 uniform, 2 bimodal (1 in 10 large).");
+module_param(size_dist, int, 0400);
+
+static ulong count = 100000;
+MODULE_PARM_DESC(count, "Messages to send over all threads, unless duration is set.");
+module_param(count, ulong, 0400);
+
+static int duration = 0;
+MODULE_PARM_DESC(duration, "Seconds to send for, 0 sends count messages.");
+module_param(duration, int, 0400);
+
+static ulong rate = 0;
+MODULE_PARM_DESC(rate, "Target messages per second over all threads, 0 for no limit.");
+module_param(rate, ulong, 0400);
+
+static int batch = 16;
+MODULE_PARM_DESC(batch, "Messages sent back to back between two pacing points.");
+module_param(batch, int, 0400);
+
+static int threads = 1;
+MODULE_PARM_DESC(threads, "Producer threads.");
+module_param(threads, int, 0400);
+
+/*
+ * one producer thread and what it did
+ * @cycles: TSC cycles spent in ringbuf_chan_send()
+*/
+struct bench_thread {
+	struct task_struct *task;
+	unsigned int id;
+	char *buf;
+	u64 quota;
+	u64 sent;
+	u64 bytes;
+	u64 drops;
+	u64 cycles;
+	u64 end;
+};
+
+static struct ringbuf_chan *rc;
+static u32 ivposition;
+static struct bench_thread bench[BENCH_MAX_THREADS];
+static atomic_t running;
+static u64 start;
+
+static size_t bench_size(void)
+{
+	switch(size_dist) {
+	case SizeUniform:
+		return msg_size + get_random_u32() % (msg_size_max - msg_size + 1);
+	case SizeBimodal:
+		return get_random_u32() % 10 ? msg_size : msg_size_max;
+	default:
+		return msg_size;
+	}
+}
+
+static void bench_report(void)
+{
+	u64 sent = 0, bytes = 0, drops = 0, cycles = 0, end = 0, ns;
+	int i;
+
+	for(i = 0; i < threads; i++) {
+		sent += bench[i].sent;
+		bytes += bench[i].bytes;
+		drops += bench[i].drops;
+		cycles += bench[i].cycles;
+		end = max(end, bench[i].end);
+	}
+	ns = end - start;
+
+	printk(KERN_INFO "bench_tx: %llu msgs %llu bytes in %llu ms by %d threads\n",
+		sent, bytes, div64_u64(ns, NSEC_PER_MSEC), threads);
+	printk(KERN_INFO "bench_tx: %llu msgs/s %llu MB/s, %llu drops, %llu cycles/msg\n",
+		bench_rate(sent, ns), bench_mbps(bytes, ns), drops,
+		sent + drops ? div64_u64(cycles, sent + drops) : 0);
+}
+
+/*
+ * sleep off how far ahead of the target rate this thread is
+ */
+static void bench_pace(struct bench_thread *t, u64 seq)
+{
+	u64 due, now;
+
+	if(!rate)
+		return;
+
+	due = start + div64_u64(seq * NSEC_PER_SEC * threads, rate);
+	now = ktime_get_ns();
+	if(due > now + NSEC_PER_USEC)
+		usleep_range(div64_u64(due - now, NSEC_PER_USEC),
+			div64_u64(due - now, NSEC_PER_USEC) + 50);
+}
+
+static bool bench_done(struct bench_thread *t, u64 seq)
+{
+	if(duration)
+		return ktime_get_ns() - start >= (u64)duration * NSEC_PER_SEC;
+
+	return seq >= t->quota;
+}
+
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *t = data;
+	struct bench_hd *hd = (struct bench_hd *)t->buf;
+	u64 seq = 0;
+	cycles_t c0;
+	ssize_t ret;
+	size_t len;
+	int i;
+
+	while(!kthread_should_stop() && !bench_done(t, seq)) {
+		for(i = 0; i < batch && !bench_done(t, seq); i++, seq++) {
+			len = bench_size();
+			hd->magic = BENCH_MAGIC;
+			hd->peer = ivposition;
+			hd->thread = t->id;
+			hd->seq = seq;
+			hd->tstamp = ktime_get_real_ns();
+
+			c0 = get_cycles();
+			ret = ringbuf_chan_send(rc, t->buf, len, 0);
+			t->cycles += get_cycles() - c0;
+
+			if(ret == len) {
+				t->sent++;
+				t->bytes += len;
+			} else if(ret == -ENOBUFS) {
+				t->drops++;
+			} else {
+				printk(KERN_ERR "bench_tx: thread %u send failed: %zd\n",
+					t->id, ret);
+				goto out;
+			}
+		}
+
+		bench_pace(t, seq);
+		cond_resched();
+	}
+
+out:
+	t->end = ktime_get_ns();
+	if(atomic_dec_and_test(&running))
+		bench_report();
+
+	/* kthread_stop() at rmmod collects us */
+	while(!kthread_should_stop())
+		schedule_timeout_interruptible(HZ);
+
+	return 0;
+}
+
+int __init bench_tx_init(void)
+{
+	int i, ret;
+
+	if(threads < 1 || threads > BENCH_MAX_THREADS || batch < 1)
+		return -EINVAL;
+	if(msg_size_max < msg_size)
+		msg_size_max = msg_size;
+	if(msg_size < sizeof(struct bench_hd) || msg_size_max > BENCH_MAX_SZ) {
+		printk(KERN_ERR "bench_tx: sizes must be within [%zu, %d]\n",
+			sizeof(struct bench_hd), BENCH_MAX_SZ);
+		return -EINVAL;
+	}
+
+	rc = ringbuf_chan_open(0);
+	if(IS_ERR(rc))
+		return PTR_ERR(rc);
+	ivposition = ringbuf_ivposition();
+
+	for(i = 0; i < threads; i++) {
+		bench[i].id = i;
+		bench[i].quota = count / threads + (i == 0 ? count % threads : 0);
+		bench[i].buf = kzalloc(BENCH_MAX_SZ, GFP_KERNEL);
+		if(!bench[i].buf) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	printk(KERN_INFO "bench_tx: peer %u, %d threads, sizes %d..%d dist %d, rate %lu\n",
+		ivposition, threads, msg_size, msg_size_max, size_dist, rate);
+
+	atomic_set(&running, threads);
+	start = ktime_get_ns();
+	for(i = 0; i < threads; i++) {
+		bench[i].task = kthread_run(bench_thread_fn, &bench[i],
+						"bench_tx/%d", i);
+		if(IS_ERR(bench[i].task)) {
+			ret = PTR_ERR(bench[i].task);
+			bench[i].task = NULL;
+			goto stop;
+		}
+	}
+
+	return 0;
+
+stop:
+	while(--i >= 0)
+		kthread_stop(bench[i].task);
+error:
+	for(i = 0; i < threads; i++)
+		kfree(bench[i].buf);
+	ringbuf_chan_close(rc);
+	return ret;
+}
+
+void __exit bench_tx_exit(void)
+{
+	int i;
+
+	for(i = 0; i < threads; i++) {
+		kthread_stop(bench[i].task);
+		kfree(bench[i].buf);
+	}
+	ringbuf_chan_close(rc);
+}
+
+module_init(bench_tx_init);
+module_exit(bench_tx_exit);
+
+MODULE_LICENSE("GPL");
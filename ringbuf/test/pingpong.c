@@ -0,0 +1,295 @@
+/*
+ * round trip latency between two VMs: "ping" sends a message on one
+ * channel, "pong" sends it back on another, N times, and ping prints
+ * the distribution of the round trips. The wait strategy picks how the
+ * message is picked up on both sides:
+ *
+ *	tasklet	 RPC call and serve, the tasklet completes the waiter
+ *	block	 IOCTL_RECV sleeping until the interrupt wakes it
+ *	poll	 IOCTL_RECV spinning on RBIO_NONBLOCK
+ *
+ * block and poll want the driver loaded with LOG_MSGS=0. Built static
+ * so that it runs from the ash of the demo VMs:
+ *
+ *	pong VM: ./pingpong pong -m block
+ *	ping VM: ./pingpong ping -m block -n 100000 -s 64
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef struct ringbuf_msg_io {
+	u32 chan;
+	u32 len;
+	u64 buf;
+	u32 flags;
+	u32 raw_len;
+} rbmsg_io;
+
+typedef struct ringbuf_rpc {
+	u32 chan;
+	u32 corr_id;
+	u32 reply_chan;
+	u32 len;
+	u64 buf;
+	u32 rlen;
+	u32 pad;
+	u64 rbuf;
+} rbrpc;
+
+#define IOCTL_MAGIC		('f')
+#define IOCTL_RPC_BIND		_IOW(IOCTL_MAGIC, 6, u32)
+#define IOCTL_RPC_CALL		_IOWR(IOCTL_MAGIC, 7, rbrpc)
+#define IOCTL_RPC_RECV		_IOWR(IOCTL_MAGIC, 10, rbrpc)
+#define IOCTL_RPC_REPLY		_IOW(IOCTL_MAGIC, 11, rbrpc)
+#define IOCTL_SEND		_IOW(IOCTL_MAGIC, 13, rbmsg_io)
+#define IOCTL_RECV		_IOWR(IOCTL_MAGIC, 14, rbmsg_io)
+
+#define RBIO_NONBLOCK		0x01
+#define ChanRpcServer		2
+#define ChanRpcClient		3
+
+#define MAX_SZ			4096
+
+enum {
+	WaitTasklet	=	0,
+	WaitBlock	=	1,
+	WaitPoll	=	2,
+};
+
+static int fd;
+static int mode = WaitBlock;
+static unsigned int ping_chan = 1, pong_chan = 2;
+static char buf[MAX_SZ], rbuf[MAX_SZ];
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int msg_send(unsigned int chan, void *p, u32 len)
+{
+	rbmsg_io io = { .chan = chan, .len = len, .buf = (uintptr_t)p };
+
+	return ioctl(fd, IOCTL_SEND, &io) < 0 ? -errno : 0;
+}
+
+static int msg_recv(unsigned int chan, void *p, u32 len)
+{
+	rbmsg_io io = { .chan = chan, .len = len, .buf = (uintptr_t)p };
+
+	if (mode == WaitPoll)
+		io.flags = RBIO_NONBLOCK;
+
+	while (ioctl(fd, IOCTL_RECV, &io) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+	}
+
+	return io.len;
+}
+
+static int bind_chan(unsigned int chan, unsigned int chan_mode)
+{
+	if (ioctl(fd, IOCTL_RPC_BIND, (chan << 16) | chan_mode) < 0) {
+		perror("IOCTL_RPC_BIND");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* one round trip, ping side */
+static int ping_once(u32 len)
+{
+	rbrpc rpc = {
+		.chan = ping_chan, .len = len, .buf = (uintptr_t)buf,
+		.rlen = MAX_SZ, .rbuf = (uintptr_t)rbuf,
+	};
+	int ret;
+
+	if (mode == WaitTasklet)
+		return ioctl(fd, IOCTL_RPC_CALL, &rpc) < 0 ? -errno : 0;
+
+	ret = msg_send(ping_chan, buf, len);
+	if (ret < 0)
+		return ret;
+	ret = msg_recv(pong_chan, rbuf, MAX_SZ);
+	return ret < 0 ? ret : 0;
+}
+
+static int pong(void)
+{
+	rbrpc rpc;
+	int ret;
+
+	if (mode == WaitTasklet && bind_chan(ping_chan, ChanRpcServer))
+		return 1;
+
+	for (;;) {
+		if (mode == WaitTasklet) {
+			memset(&rpc, 0, sizeof(rpc));
+			rpc.chan = ping_chan;
+			rpc.rlen = MAX_SZ;
+			rpc.rbuf = (uintptr_t)rbuf;
+			if (ioctl(fd, IOCTL_RPC_RECV, &rpc) < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				perror("IOCTL_RPC_RECV");
+				return 1;
+			}
+			rpc.chan = rpc.reply_chan;
+			rpc.len = rpc.rlen;
+			rpc.buf = (uintptr_t)rbuf;
+			ret = ioctl(fd, IOCTL_RPC_REPLY, &rpc) < 0 ? -errno : 0;
+		} else {
+			ret = msg_recv(ping_chan, rbuf, MAX_SZ);
+			if (ret > 0)
+				ret = msg_send(pong_chan, rbuf, ret);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "pong: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(u64 *rtt, unsigned long n)
+{
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	unsigned long i, hist[64] = { 0 };
+	u64 sum = 0;
+	int b;
+
+	qsort(rtt, n, sizeof(*rtt), cmp_u64);
+	for (i = 0; i < n; i++) {
+		sum += rtt[i];
+		hist[rtt[i] ? 63 - __builtin_clzll(rtt[i]) : 0]++;
+	}
+
+	printf("%lu round trips, ns: min %llu mean %llu", n,
+		(unsigned long long)rtt[0], (unsigned long long)(sum / n));
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf(" p%g %llu", pct[i], (unsigned long long)
+			rtt[(unsigned long)(pct[i] / 100 * (n - 1) + 0.5)]);
+	printf(" max %llu\n", (unsigned long long)rtt[n - 1]);
+
+	for (b = 0; b < 64; b++)
+		if (hist[b])
+			printf("  [%12llu, %12llu) %lu\n", 1ULL << b,
+				1ULL << (b + 1), hist[b]);
+}
+
+static int ping(unsigned long iters, unsigned long warmup, u32 len)
+{
+	unsigned long i;
+	u64 *rtt, t0;
+	int ret;
+
+	if (mode == WaitTasklet && bind_chan(pong_chan, ChanRpcClient))
+		return 1;
+
+	rtt = calloc(iters, sizeof(*rtt));
+	if (!rtt)
+		return 1;
+
+	for (i = 0; i < warmup + iters; i++) {
+		t0 = now_ns();
+		ret = ping_once(len);
+		if (ret < 0) {
+			fprintf(stderr, "ping %lu: %s\n", i, strerror(-ret));
+			return 1;
+		}
+		if (i >= warmup)
+			rtt[i - warmup] = now_ns() - t0;
+	}
+
+	report(rtt, iters);
+	free(rtt);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pingpong ping|pong [-m tasklet|block|poll] "
+		"[-n iters] [-w warmup] [-s size] [-a ping_chan] [-b pong_chan]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iters = 10000, warmup = 100;
+	u32 len = 64;
+	int opt;
+
+	if (argc < 2)
+		usage();
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "m:n:w:s:a:b:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (!strcmp(optarg, "tasklet"))
+				mode = WaitTasklet;
+			else if (!strcmp(optarg, "block"))
+				mode = WaitBlock;
+			else if (!strcmp(optarg, "poll"))
+				mode = WaitPoll;
+			else
+				usage();
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			len = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			ping_chan = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			pong_chan = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!iters || !len || len > MAX_SZ)
+		usage();
+
+	fd = open("/dev/ringbuf", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/ringbuf");
+		return 1;
+	}
+	memset(buf, 'p', sizeof(buf));
+
+	if (!strcmp(argv[1], "ping"))
+		return ping(iters, warmup, len);
+	if (!strcmp(argv[1], "pong"))
+		return pong();
+	usage();
+	return 2;
+}
@@ -0,0 +1,390 @@
+/*
+ * userspace harness of the ring protocol: producer and consumer
+ * processes sharing a memfd laid out like a channel of BAR2, with
+ * eventfds standing in for the doorbells. Runs the same ring code as
+ * the driver (../src/ringbuf_core.h), so the ring can be stressed,
+ * profiled and run under sanitizers without QEMU.
+ *
+ *	make ring_harness && ./ring_harness -p 4 -n 1000000 -s 64 -S 1024
+ *	make ring_harness SAN=thread
+ *
+ * Every payload carries a pattern derived from its lane and sequence
+ * number that the consumer checks, along with the sequence numbers;
+ * the exit status is 1 if anything was lost, duplicated or corrupted.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#include "../src/ringbuf_core.h"
+
+/*
+ * the shared memory: one channel ring, the producers' write_lock and
+ * one lane slice per producer
+ * @consumer_waiting: set by the consumer before it sleeps on its
+ *		      doorbell, producers only ring it then
+*/
+struct harness_shm {
+	rbring ring;
+	rblock lock;
+	int consumer_waiting ____cacheline_aligned;
+	int go;
+	char arena[] ____cacheline_aligned;
+};
+
+static struct harness_shm *shm;
+static int doorbell;
+static int space[RINGBUF_MAX_PEERS];
+static int kick[RINGBUF_MAX_PEERS];
+
+static unsigned int producers = 1;
+static unsigned long count = 100000;
+static unsigned int size_min = 64, size_max = 64;
+static unsigned int lane_sz = 32768;
+static bool busy_poll, verify = true;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void ring_doorbell(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		perror("doorbell");
+}
+
+static void wait_doorbell(int efd)
+{
+	uint64_t val;
+
+	if (read(efd, &val, sizeof(val)) != sizeof(val))
+		perror("wait doorbell");
+}
+
+static unsigned char pattern(unsigned int lane, unsigned int seq, size_t i)
+{
+	return (lane * 31 + seq * 7 + i) & 0xff;
+}
+
+/*
+ * take write_lock as the driver does, parking on our kick eventfd once
+ * the spin is over
+ */
+static void lock(unsigned int lane)
+{
+	unsigned int t = rblock_ticket(&shm->lock, lane);
+	unsigned int i;
+
+	for (i = 0; !rblock_granted(&shm->lock, t); i++) {
+		if (busy_poll || i < 1024) {
+			cpu_relax();
+			continue;
+		}
+		if (!rblock_park(&shm->lock, lane, t))
+			wait_doorbell(kick[lane]);
+	}
+}
+
+static void unlock(unsigned int lane)
+{
+	unsigned int t = rblock_release(&shm->lock, lane);
+	int next = rblock_waiter(&shm->lock, t);
+
+	if (next >= 0 && rblock_unpark(&shm->lock, next))
+		ring_doorbell(kick[next]);
+}
+
+/*
+ * wait for the consumer to make room, as a producer blocked on a full
+ * ring does: flag ourselves in ring->waiters, check again, sleep
+ */
+static void wait_space(unsigned int lane, bool (*room)(void *), void *arg)
+{
+	if (busy_poll) {
+		cpu_relax();
+		return;
+	}
+
+	__atomic_fetch_or(&shm->ring.waiters, 1UL << lane, __ATOMIC_SEQ_CST);
+	if (!room(arg))
+		wait_doorbell(space[lane]);
+}
+
+struct producer {
+	unsigned int lane;
+	rbwindow win;
+	unsigned int pt;
+	size_t len;
+	long off;
+};
+
+static bool producer_room(void *arg)
+{
+	struct producer *p = arg;
+
+	rbwindow_release(&p->win,
+		__atomic_load_n(&shm->ring.ack[p->lane], __ATOMIC_ACQUIRE));
+	p->off = rbwindow_alloc(&p->win, p->pt, lane_sz,
+				p->len <= RBSLOT_INLINE ? 0 : p->len);
+
+	return p->off >= 0 && rbring_used(&shm->ring) < RINGBUF_SLOTS;
+}
+
+static bool ring_room(void *arg)
+{
+	return rbring_used(&shm->ring) < RINGBUF_SLOTS;
+}
+
+static int producer(unsigned int lane)
+{
+	struct producer p = { .lane = lane };
+	char *slice = shm->arena + (size_t)lane * lane_sz;
+	char small[RBSLOT_INLINE], *payload;
+	unsigned int seed = lane + 1;
+	unsigned long n;
+	rbmsg_hd hd;
+	size_t i;
+	int ret;
+
+	while (!__atomic_load_n(&shm->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	for (n = 1; n <= count; n++) {
+		p.len = size_min + (size_max > size_min ?
+			rand_r(&seed) % (size_max - size_min + 1) : 0);
+
+		while (!producer_room(&p))
+			wait_space(lane, producer_room, &p);
+
+		/* small ones go inline, like ringbuf_send() does */
+		payload = p.len <= RBSLOT_INLINE ? small : slice + p.off;
+		if (verify || payload == small)
+			for (i = 0; i < p.len; i++)
+				payload[i] = pattern(lane, n, i);
+
+		hd.src_qid = lane;
+		hd.src_gen = 1;
+		hd.seq = n;
+		hd.flags = payload == small ? RBMSG_INLINE : 0;
+		hd.corr_id = 0;
+		hd.tstamp = now_ns();
+		hd.payload_off = lane * lane_sz + p.off;
+		hd.payload_len = p.len;
+		hd.raw_len = p.len;
+
+		for (;;) {
+			lock(lane);
+			ret = rbring_publish(&shm->ring, &hd, small);
+			unlock(lane);
+			if (!ret)
+				break;
+			wait_space(lane, ring_room, NULL);
+		}
+
+		rbwindow_push(&p.win, &hd, p.off, small);
+		if (payload != small)
+			p.pt = p.off + p.len;
+
+		/* a full barrier against the consumer going to sleep */
+		if (!busy_poll &&
+		    __atomic_fetch_or(&shm->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+			ring_doorbell(doorbell);
+	}
+
+	return 0;
+}
+
+/* wake the producers waiting for room, like ringbuf_kick_waiters() */
+static void kick_waiters(void)
+{
+	unsigned long waiters;
+	unsigned int lane;
+
+	if (!__atomic_load_n(&shm->ring.waiters, __ATOMIC_SEQ_CST))
+		return;
+
+	waiters = __atomic_exchange_n(&shm->ring.waiters, 0, __ATOMIC_SEQ_CST);
+	for (lane = 0; lane < producers; lane++)
+		if (waiters & (1UL << lane))
+			ring_doorbell(space[lane]);
+}
+
+static int consumer(void)
+{
+	unsigned long long start, lat, sum_lat = 0, max_lat = 0, bytes = 0;
+	unsigned long hist[64] = { 0 }, errors = 0, seen = 0, total, i;
+	unsigned int expect[RINGBUF_MAX_PEERS], b, p50 = 0, p99 = 0;
+	rbmsg_hd hd;
+	size_t j;
+	char *payload;
+
+	for (b = 0; b < RINGBUF_MAX_PEERS; b++)
+		expect[b] = 1;
+	total = count * producers;
+
+	while (!__atomic_load_n(&shm->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	start = now_ns();
+
+	for (i = 0; i < total; ) {
+		if (rbring_peek(&shm->ring, &hd)) {
+			if (busy_poll) {
+				cpu_relax();
+				continue;
+			}
+			__atomic_store_n(&shm->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+			if (rbring_peek(&shm->ring, &hd))
+				wait_doorbell(doorbell);
+			__atomic_store_n(&shm->consumer_waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		lat = now_ns() - hd.tstamp;
+		sum_lat += lat;
+		max_lat = lat > max_lat ? lat : max_lat;
+		hist[lat ? 63 - __builtin_clzll(lat) : 0]++;
+
+		if (hd.src_qid >= producers || hd.seq != expect[hd.src_qid] ||
+		    hd.payload_len < 0 || ((hd.flags & RBMSG_INLINE) ?
+		    hd.payload_len > RBSLOT_INLINE : hd.payload_off +
+				hd.payload_len > (size_t)producers * lane_sz)) {
+			fprintf(stderr, "bad header: lane %u seq %u (expected %u) off %u len %zd\n",
+				hd.src_qid, hd.seq, hd.src_qid < producers ?
+				expect[hd.src_qid] : 0, hd.payload_off,
+				hd.payload_len);
+			errors++;
+			rbring_skip(&shm->ring);
+			i++;
+			continue;
+		}
+
+		payload = (hd.flags & RBMSG_INLINE) ?
+			(char *)rbring_inline(&shm->ring) :
+			shm->arena + hd.payload_off;
+		if (verify)
+			for (j = 0; j < (size_t)hd.payload_len; j++)
+				if ((unsigned char)payload[j] !=
+				    pattern(hd.src_qid, hd.seq, j)) {
+					fprintf(stderr, "corrupt payload: lane %u seq %u at %zu\n",
+						hd.src_qid, hd.seq, j);
+					errors++;
+					break;
+				}
+
+		bytes += hd.payload_len;
+		expect[hd.src_qid]++;
+		rbring_consume(&shm->ring, hd.src_qid, hd.seq);
+		kick_waiters();
+		i++;
+	}
+
+	start = now_ns() - start;
+	for (b = 0; b < 64; b++) {
+		seen += hist[b];
+		if (!p50 && seen * 2 >= total)
+			p50 = b;
+		if (!p99 && seen * 100 >= total * 99)
+			p99 = b;
+	}
+
+	printf("%lu msgs %llu bytes in %llu ms by %u producers: %llu msgs/s %llu MB/s\n",
+		total, bytes, start / 1000000, producers,
+		total * 1000000000ULL / start, bytes * 1000 / start);
+	printf("latency ns: mean %llu p50 < %llu p99 < %llu max %llu\n",
+		sum_lat / total, 2ULL << p50, 2ULL << p99, max_lat);
+	printf("%lu errors\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: ring_harness [-p producers] [-n msgs per producer] "
+		"[-s size] [-S max size] [-l lane size] [-P (busy poll)] "
+		"[-q (no payload check)]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t shm_sz;
+	pid_t pid;
+	int opt, fd, status, ret = 0;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "p:n:s:S:l:Pq")) != -1) {
+		switch (opt) {
+		case 'p': producers = strtoul(optarg, NULL, 0); break;
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		case 's': size_min = strtoul(optarg, NULL, 0); break;
+		case 'S': size_max = strtoul(optarg, NULL, 0); break;
+		case 'l': lane_sz = strtoul(optarg, NULL, 0); break;
+		case 'P': busy_poll = true; break;
+		case 'q': verify = false; break;
+		default: usage();
+		}
+	}
+	if (size_max < size_min)
+		size_max = size_min;
+	if (!producers || producers > RINGBUF_MAX_PEERS || !count ||
+	    !size_min || size_max > lane_sz)
+		usage();
+
+	shm_sz = sizeof(*shm) + (size_t)producers * lane_sz;
+	fd = memfd_create("ringbuf", 0);
+	if (fd < 0 || ftruncate(fd, shm_sz) < 0) {
+		perror("memfd");
+		return 1;
+	}
+	shm = mmap(NULL, shm_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	shm->ring.size = RINGBUF_SLOTS;
+	rblock_init(&shm->lock);
+
+	doorbell = eventfd(0, 0);
+	for (i = 0; i < producers; i++) {
+		space[i] = eventfd(0, 0);
+		kick[i] = eventfd(0, 0);
+	}
+
+	for (i = 0; i <= producers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0)
+			exit(i == producers ? consumer() : producer(i));
+	}
+
+	__atomic_store_n(&shm->go, 1, __ATOMIC_RELEASE);
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+
+	return ret;
+}
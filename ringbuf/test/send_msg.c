@@ -10,34 +10,31 @@
 #include <linux/delay.h>
 #include <linux/jiffies.h>
 
-extern unsigned long volatile jiffies;
+#include "../src/ringbuf.h"
 
-#define IOCTL_MAGIC		('f')
-#define IOCTL_RING		_IOW(IOCTL_MAGIC, 1, u32)
-#define IOCTL_WAIT		_IO(IOCTL_MAGIC, 2)
-#define IOCTL_IVPOSITION	_IOR(IOCTL_MAGIC, 3, u32)
+extern unsigned long volatile jiffies;
  
 int __init sendmsg_init(void)
 {
-        struct file *fp = NULL;
-        loff_t pos = 0;
+        struct ringbuf_chan *rc;
         int i, cyc = 20;
-        long ivposition;
+        u32 ivposition;
         char msg[256];
 
-        fp = filp_open("/dev/ringbuf", O_RDWR, 0644);
-        ivposition = fp->f_op->unlocked_ioctl(fp, IOCTL_IVPOSITION, 0);
+        rc = ringbuf_chan_open(0);
+        if (IS_ERR(rc))
+                return PTR_ERR(rc);
+        ivposition = ringbuf_ivposition();
 
         printk("send_message test case start.\n");
         for(i = 0; i < cyc; i++) {
-                sprintf(msg, "MSG #%d   from peer%ld   (jiffies: %lu)", i, ivposition, jiffies);
-                fp->f_op->write(fp, msg, strlen(msg) + 1, &pos);
+                sprintf(msg, "MSG #%d   from peer%u   (jiffies: %lu)", i, ivposition, jiffies);
+                ringbuf_chan_send(rc, msg, strlen(msg) + 1, 0);
                 printk(KERN_INFO "msg sent: %s", msg);
                 msleep(3000);
         }
         
-        filp_close(fp, NULL);
-        fp = NULL;
+        ringbuf_chan_close(rc);
         return 0;
 }
 